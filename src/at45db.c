@@ -35,9 +35,170 @@
 
 #define CHIP_ERASE_CHECK_RATE (500 / portTICK_PERIOD_MS)
 
+#if AT45DB_USE_WEAR == 1
+#ifndef AT45DB_WEAR_SYNC_CNT
+  #define AT45DB_WEAR_SYNC_CNT 256
+#endif
+#define WEAR_MAGIC 0x57454152
+// Wear image layout (uint32_t words).
+#define WEAR_MAGIC_IDX 0
+#define WEAR_SEQ_IDX   1
+#define WEAR_CRC_IDX   2
+#define WEAR_SPROG_IDX 3
+#define WEAR_ERASE_IDX (WEAR_SPROG_IDX + AT45DB_SECT_COUNT)
+#define wear_img_size(fi) ((WEAR_ERASE_IDX + (fi)->bl_count) * sizeof(uint32_t))
+#endif
+
+#if AT45DB_USE_REFRESH == 1
+#ifndef AT45DB_REFRESH_PAGES
+  #define AT45DB_REFRESH_PAGES 1
+#endif
+#ifndef AT45DB_REFRESH_PERIOD
+  #define AT45DB_REFRESH_PERIOD (1000 / portTICK_PERIOD_MS)
+#endif
+#ifndef AT45DB_REFRESH_LIMIT
+  #define AT45DB_REFRESH_LIMIT 5000
+#endif
+#ifndef AT45DB_REFRESH_BUF
+  #define AT45DB_REFRESH_BUF 1
+#endif
+#endif
+
+#if AT45DB_USE_READ_AHEAD == 1
+#ifndef AT45DB_READ_AHEAD_TRIG
+  #define AT45DB_READ_AHEAD_TRIG 2
+#endif
+#endif
+
+#if AT45DB_USE_TRACE == 1
+#ifndef AT45DB_TRACE_TIME
+  #define AT45DB_TRACE_TIME() xTaskGetTickCount()
+#endif
+#endif
+
+#if AT45DB_USE_RT == 1
+#ifndef AT45DB_RT_TIME
+  #define AT45DB_RT_TIME() xTaskGetTickCount()
+#endif
+// Lock of instrumented function, function returns -EHW if lock is not taken in time.
+#define RT_LOCK(fi) uint32_t rt_t0 = AT45DB_RT_TIME(); \
+                    if (!rt_lock(fi)) { \
+                            return (-EHW); \
+                    }
+#define RT_EXIT(fi, api) rt_exit(fi, api, rt_t0)
+#define RT_LEFT(fi, t) rt_left(fi, t)
+#else
+#define RT_LOCK(fi) lock(fi)
+#define RT_EXIT(fi, api)
+#define RT_LEFT(fi, t) (t)
+#endif
+
+#if AT45DB_USE_TIMING == 1
+// Fixed point scale of operation time estimates.
+#define TM_SCALE 16
+
+struct part_prof {
+	enum at45db_part part;
+	unsigned short tm_ms[AT45DB_OP_COUNT];
+};
+
+// Typical operation times (ms), refined by measurement.
+static const struct part_prof part_prof[] = {
+	{AT45DB_PART_642,  {20, 14, 8, 12, 21}},
+	{AT45DB_PART_642D, {17, 3, 15, 45, 18}},
+	{AT45DB_PART_641E, {8, 2, 6, 25, 9}}
+};
+#endif
+
+#if AT45DB_USE_SVC == 1
+#ifndef AT45DB_SVC_PERIOD
+  #define AT45DB_SVC_PERIOD (1000 / portTICK_PERIOD_MS)
+#endif
+#ifndef AT45DB_SVC_IDLE_TIME
+  #define AT45DB_SVC_IDLE_TIME (20 / portTICK_PERIOD_MS)
+#endif
+#ifndef AT45DB_SVC_STACK_SIZE
+  #define AT45DB_SVC_STACK_SIZE configMINIMAL_STACK_SIZE
+#endif
+#endif
+
+#if AT45DB_USE_PWR_MNG == 1
+#ifndef AT45DB_RDPD_TIME
+  #define AT45DB_RDPD_TIME 1
+#endif
+#ifndef AT45DB_XUDPD_TIME
+  #define AT45DB_XUDPD_TIME 1
+#endif
+#ifndef AT45DB_VCC_MV
+  #define AT45DB_VCC_MV 3300
+#endif
+#ifndef AT45DB_STBY_CURR_NA
+  #define AT45DB_STBY_CURR_NA 25000
+#endif
+#ifndef AT45DB_DPD_CURR_NA
+  #define AT45DB_DPD_CURR_NA 5000
+#endif
+#ifndef AT45DB_UDPD_CURR_NA
+  #define AT45DB_UDPD_CURR_NA 400
+#endif
+#endif
+
+static int trans(at45db fi, unsigned char *cmd, int cmd_sz, unsigned char *buf, int num,
+                 boolean_t dma);
 static int wait_ready(at45db fi);
+static int cmp_buf(at45db fi, int bfn, int page);
+static int blank_check(at45db fi, int page);
+#if AT45DB_USE_RT == 1
+static boolean_t rt_lock(at45db fi);
+static void rt_exit(at45db fi, enum at45db_api api, uint32_t t0);
+static TickType_t rt_base(at45db fi);
+static TickType_t rt_left(at45db fi, TickType_t t);
+static boolean_t rt_expired(at45db fi, TickType_t t0);
+#endif
+static int wait_op(at45db fi, enum at45db_op op);
+static TickType_t op_dflt_time(enum at45db_op op);
+static void lock(at45db fi);
+static boolean_t lock_tmo(at45db fi, TickType_t tmo);
+static void unlock(at45db fi);
 static boolean_t create_address(at45db fi, unsigned char *cmd, int page, int offs);
 static void adrbits(at45db fi, int page, int offs, unsigned char *p);
+static void buf_set(at45db fi, int bfn, enum at45db_buf_state state, int page);
+static void buf_inval(at45db fi, int page, int num);
+#if AT45DB_USE_SVC == 1
+static void svc_tsk(void *p);
+#if AT45DB_USE_REFRESH == 1 || AT45DB_USE_WEAR == 1
+static int svc_buf(at45db fi, int bfn);
+#endif
+#endif
+#if AT45DB_USE_ERASE_AHEAD == 1
+static boolean_t ea_step(at45db fi);
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+static boolean_t em_erased(at45db fi, int page);
+static void em_mark(at45db fi, int page, int num, boolean_t erased);
+static void em_forget(at45db fi, int page, int num);
+static void page_mark(at45db fi, int page, int num, boolean_t erased);
+#endif
+#if AT45DB_USE_PWR_MNG == 1
+static void pm_set_state(at45db fi, unsigned char state);
+static int pm_wake(at45db fi);
+#endif
+#if AT45DB_USE_REFRESH == 1
+static boolean_t rf_step(at45db fi);
+#endif
+#if AT45DB_USE_WEAR == 1
+static void wear_note(at45db fi, int page, int num, boolean_t erase);
+static int wear_slot_pages(at45db fi);
+static int wear_store(at45db fi, int bfn);
+#endif
+#if AT45DB_USE_READ_AHEAD == 1
+static int ra_read(at45db fi, unsigned char *buf, int page, int offs, int num);
+#endif
+#if AT45DB_USE_PROTECT == 1
+static int prot_cmd(at45db fi, unsigned char op, unsigned char *data, int num);
+static int prot_check(at45db fi, int page, int num);
+static boolean_t prot_page(at45db fi, int page);
+#endif
 #if AT45DB_TEST_CODE == 1
 static int t_device(at45db fi, boolean_t verb);
 static int t_readpage(at45db fi, unsigned char *buf, int page, boolean_t verb);
@@ -50,12 +211,16 @@ static int t_readpage_all(at45db fi, unsigned char *buf, boolean_t verb);
 int at45db_stat(at45db fi, unsigned int *stat)
 {
         unsigned char cmd = 0xD7;
+	int ret = 0;
 
-        if (0 != spi_trans(fi->spi, &fi->csel, &cmd, 1, &cmd, 1, DMA_OFF)) {
-		return (-EHW);
+	lock(fi);
+        if (0 != trans(fi, &cmd, 1, &cmd, 1, FALSE)) {
+		ret = -EHW;
+	} else {
+	        *stat = cmd;
 	}
-        *stat = cmd;
-	return (0);
+	unlock(fi);
+	return (ret);
 }
 
 #if AT45DB_USE_EXT_STAT == 1
@@ -65,13 +230,17 @@ int at45db_stat(at45db fi, unsigned int *stat)
 int at45db_ext_stat(at45db fi, unsigned int *stat)
 {
         unsigned char cmd[2] = {0xD7};
+	int ret = 0;
 
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd, 2, DMA_OFF)) {
-		return (-EHW);
+	lock(fi);
+        if (0 != trans(fi, cmd, 1, cmd, 2, FALSE)) {
+		ret = -EHW;
+	} else {
+	        *stat = cmd[0];
+		*stat |= cmd[1] << 8;
 	}
-        *stat = cmd[0];
-	*stat |= cmd[1] << 8;
-	return (0);
+	unlock(fi);
+	return (ret);
 }
 #endif
 
@@ -81,15 +250,33 @@ int at45db_ext_stat(at45db fi, unsigned int *stat)
 int at45db_read_mem(at45db fi, unsigned char *buf, int page, int offs, int num)
 {
         unsigned char cmd[] = {0xD2, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF};
+	int ret = 0;
 
 	if (!create_address(fi, cmd, page, offs)) {
 		return (-EADDR);
 	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd), buf, num,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	RT_LOCK(fi);
+	for (int i = 0; i < 2; i++) {
+		if (fi->bufst[i].state == AT45DB_BUF_CLEAN && fi->bufst[i].page == page) {
+			// Page is mirrored in flash buffer.
+			ret = at45db_read_buf(fi, buf, i + 1, offs, num);
+			goto exit;
+		}
+	}
+#if AT45DB_USE_READ_AHEAD == 1
+	if (fi->ra_pages && 0 != (ret = ra_read(fi, buf, page, offs, num))) {
+		// Served from read-ahead cache or read error.
+		ret = (ret > 0) ? 0 : ret;
+		goto exit;
 	}
-        return (0);
+#endif
+        if (0 != trans(fi, cmd, sizeof(cmd), buf, num, fi->use_dma)) {
+		ret = -EHW;
+	}
+exit:
+	RT_EXIT(fi, AT45DB_API_READ_MEM);
+	unlock(fi);
+        return (ret);
 }
 
 /**
@@ -98,6 +285,7 @@ int at45db_read_mem(at45db fi, unsigned char *buf, int page, int offs, int num)
 int at45db_write_mem(at45db fi, unsigned char *buf, int bfn, int page, int offs, int num)
 {
         unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	int ret;
 
         if (bfn == 1) {
                 cmd[0] = 0x82;
@@ -109,15 +297,46 @@ int at45db_write_mem(at45db fi, unsigned char *buf, int bfn, int page, int offs,
 	if (!create_address(fi, cmd, page, offs)) {
 		return (-EADDR);
 	}
-        if (bfn == 2) {
-                fi->buf2_ff = FALSE;
-        }
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd), buf, num,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	RT_LOCK(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, page, 1))) {
+		goto exit;
 	}
-        vTaskDelay(AT45DB_PAGE_ERASE_TIME);
-	return (wait_ready(fi));
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+	if (em_erased(fi, page)) {
+		// Page known to be erased, program without built-in erase.
+		if (0 == (ret = at45db_write_buf(fi, buf, bfn, offs, num))) {
+			ret = at45db_store_buf(fi, bfn, page, FALSE);
+		}
+		goto exit;
+	}
+#endif
+	buf_inval(fi, page, 1);
+	buf_set(fi, bfn, AT45DB_BUF_UNKNOWN, 0);
+        if (0 != trans(fi, cmd, sizeof(cmd), buf, num, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+	ret = wait_op(fi, AT45DB_OP_PAGE_ERASE_PROG);
+#if AT45DB_USE_VERIFY == 1
+	if (ret == 0 && fi->vfy) {
+		ret = cmp_buf(fi, bfn, page);
+	}
+#endif
+	if (ret == 0) {
+		buf_set(fi, bfn, AT45DB_BUF_CLEAN, page);
+	}
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, page, 1, FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, page, 1, TRUE);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_WRITE_MEM);
+	unlock(fi);
+	return (ret);
 }
 
 /**
@@ -126,6 +345,7 @@ int at45db_write_mem(at45db fi, unsigned char *buf, int bfn, int page, int offs,
 int at45db_read_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num)
 {
         unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00, 0xFF};
+	int ret = 0;
 
         if (bfn == 1) {
                 cmd[0] = 0xD4;
@@ -137,379 +357,2070 @@ int at45db_read_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num)
 	if (!create_address(fi, cmd, 0, offs)) {
 		return (-EADDR);
 	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd), buf, num,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	RT_LOCK(fi);
+        if (0 != trans(fi, cmd, sizeof(cmd), buf, num, fi->use_dma)) {
+		ret = -EHW;
+	}
+	RT_EXIT(fi, AT45DB_API_READ_BUF);
+	unlock(fi);
+        return (ret);
+}
+
+/**
+ * at45db_write_buf
+ */
+int at45db_write_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num)
+{
+        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	int ret = 0;
+
+        if (bfn == 1) {
+                cmd[0] = 0x84;
+        } else if (bfn == 2) {
+                cmd[0] = 0x87;
+        } else {
+                crit_err_exit(BAD_PARAMETER);
+        }
+	if (!create_address(fi, cmd, 0, offs)) {
+		return (-EADDR);
+	}
+	RT_LOCK(fi);
+	fi->bufst[bfn - 1].ff = FALSE;
+	if (fi->bufst[bfn - 1].state == AT45DB_BUF_UNKNOWN) {
+		// Staged data not loaded from page.
+		fi->bufst[bfn - 1].page = -1;
+	}
+	fi->bufst[bfn - 1].state = AT45DB_BUF_DIRTY;
+        if (0 != trans(fi, cmd, sizeof(cmd), buf, num, fi->use_dma)) {
+                  ret = -EHW;
+	}
+	RT_EXIT(fi, AT45DB_API_WRITE_BUF);
+	unlock(fi);
+        return (ret);
+}
+
+/**
+ * at45db_store_buf
+ */
+int at45db_store_buf(at45db fi, int bfn, int page, boolean_t erase)
+{
+        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	boolean_t mirror;
+	int ret;
+
+	if (bfn != 1 && bfn != 2) {
+                crit_err_exit(BAD_PARAMETER);
+	}
+	if (!create_address(fi, cmd, page, 0)) {
+		return (-EADDR);
+	}
+	RT_LOCK(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, page, 1))) {
+		goto exit;
+	}
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+	if (erase && em_erased(fi, page)) {
+		erase = FALSE;
+	}
+#endif
+        if (bfn == 1) {
+                if (erase) {
+                        cmd[0] = 0x83;
+                } else {
+                        cmd[0] = 0x88;
+                }
+        } else {
+                if (erase) {
+                        cmd[0] = 0x86;
+                } else {
+                        cmd[0] = 0x89;
+                }
+        }
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		// Page content is unknown.
+		buf_inval(fi, page, 1);
+		ret = -EHW;
+		goto exit;
+	}
+	ret = wait_op(fi, (erase) ? AT45DB_OP_PAGE_ERASE_PROG : AT45DB_OP_PAGE_PROG);
+	// Page programmed without erase equals buffer only if it was erased
+	// or mirrored by the buffer.
+	mirror = (erase || (fi->bufst[bfn - 1].state == AT45DB_BUF_CLEAN &&
+	                    fi->bufst[bfn - 1].page == page)
+#if AT45DB_USE_ERASE_MAP == 1
+	          || em_erased(fi, page)
+#endif
+	          ) ? TRUE : FALSE;
+#if AT45DB_USE_VERIFY == 1
+	// Buffer loaded from page and modified must equal page too.
+	if (ret == 0 && fi->vfy && (mirror || (fi->bufst[bfn - 1].state == AT45DB_BUF_DIRTY &&
+	                                       fi->bufst[bfn - 1].page == page))) {
+		if (0 == (ret = cmp_buf(fi, bfn, page))) {
+			mirror = TRUE;
+		}
+	}
+#endif
+	buf_inval(fi, page, 1);
+	if (ret == 0 && mirror) {
+		buf_set(fi, bfn, AT45DB_BUF_CLEAN, page);
+	}
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, page, 1, FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, page, 1, erase);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_STORE_BUF);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_store_buf_start
+ */
+int at45db_store_buf_start(at45db fi, int bfn, int page, boolean_t erase)
+{
+        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	int ret = 0;
+
+	if (bfn != 1 && bfn != 2) {
+                crit_err_exit(BAD_PARAMETER);
+	}
+	if (!create_address(fi, cmd, page, 0)) {
+		return (-EADDR);
+	}
+	lock(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, page, 1))) {
+		goto exit;
+	}
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+	if (erase && em_erased(fi, page)) {
+		erase = FALSE;
+	}
+#endif
+	if (bfn == 1) {
+		cmd[0] = (erase) ? 0x83 : 0x88;
+	} else {
+		cmd[0] = (erase) ? 0x86 : 0x89;
+	}
+	buf_inval(fi, page, 1);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, page, 1, FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, page, 1, erase);
+#endif
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_wait_ready
+ */
+int at45db_wait_ready(at45db fi)
+{
+	int ret;
+
+	lock(fi);
+	ret = wait_ready(fi);
+	unlock(fi);
+	return (ret);
+}
+
+#if AT45DB_USE_RT == 1
+/**
+ * at45db_chip_erase_start
+ */
+int at45db_chip_erase_start(at45db fi)
+{
+        unsigned char cmd[] = {0xC7, 0x94, 0x80, 0x9A};
+	int ret = 0;
+
+	lock(fi);
+	buf_inval(fi, 0, fi->pg_count);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, 0, fi->pg_count, FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, 0, fi->pg_count, TRUE);
+#endif
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_busy
+ */
+int at45db_busy(at45db fi)
+{
+	int ret;
+
+	lock(fi);
+#if AT45DB_USE_EXT_STAT == 1
+	unsigned int stat;
+
+	if (0 != at45db_ext_stat(fi, &stat)) {
+		ret = -EHW;
+	} else if (!(stat & AT45DB_FLASH_READY2)) {
+		ret = 1;
+	} else {
+		ret = (stat & AT45DB_PROG_ERR) ? -EDATA : 0;
+	}
+#else
+	unsigned char stat = 0xD7;
+
+	if (0 != trans(fi, &stat, 1, &stat, 1, FALSE)) {
+		ret = -EHW;
+	} else {
+		ret = (stat & AT45DB_FLASH_READY) ? 0 : 1;
+	}
+#endif
+	if (ret == 0) {
+		// Service task can continue.
+		fi->rt_busy = FALSE;
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_wcet
+ */
+uint32_t at45db_wcet(at45db fi, enum at45db_api api, boolean_t reset)
+{
+	uint32_t t;
+
+	lock(fi);
+	t = fi->rt_wcet[api];
+	if (reset) {
+		fi->rt_wcet[api] = 0;
+	}
+	unlock(fi);
+	return (t);
+}
+#endif
+
+/**
+ * at45db_load_buf
+ */
+int at45db_load_buf(at45db fi, int bfn, int page)
+{
+        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	int ret = 0;
+
+        if (bfn == 1) {
+                cmd[0] = 0x53;
+        } else if (bfn == 2) {
+                cmd[0] = 0x55;
+        } else {
+                crit_err_exit(BAD_PARAMETER);
+        }
+	if (!create_address(fi, cmd, page, 0)) {
+		return (-EADDR);
+	}
+	RT_LOCK(fi);
+	if (fi->bufst[bfn - 1].state == AT45DB_BUF_CLEAN && fi->bufst[bfn - 1].page == page) {
+		// Page already in buffer.
+		goto exit;
+	}
+	buf_set(fi, bfn, AT45DB_BUF_UNKNOWN, 0);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+	if (0 != (ret = wait_ready(fi))) {
+		goto exit;
+	}
+	buf_set(fi, bfn, AT45DB_BUF_CLEAN, page);
+exit:
+	RT_EXIT(fi, AT45DB_API_LOAD_BUF);
+	unlock(fi);
+        return (ret);
+}
+
+/**
+ * at45db_compare_buf
+ */
+int at45db_compare_buf(at45db fi, int bfn, int page)
+{
+	int ret;
+
+	if (bfn != 1 && bfn != 2) {
+                crit_err_exit(BAD_PARAMETER);
 	}
-        return (0);
+        if (page < 0 || page >= fi->pg_count) {
+                return (-EADDR);
+        }
+	lock(fi);
+	ret = cmp_buf(fi, bfn, page);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_page_erase
+ */
+int at45db_page_erase(at45db fi, int page)
+{
+        unsigned char cmd[] = {0x81, 0x00, 0x00, 0x00};
+	int ret;
+
+	if (!create_address(fi, cmd, page, 0)) {
+		return (-EADDR);
+	}
+	RT_LOCK(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, page, 1))) {
+		goto exit;
+	}
+#endif
+	buf_inval(fi, page, 1);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+	ret = wait_op(fi, AT45DB_OP_PAGE_ERASE);
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, page, 1, (ret == 0) ? TRUE : FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, page, 1, TRUE);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_PAGE_ERASE);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_check_page_erased
+ */
+int at45db_check_page_erased(at45db fi, int page)
+{
+	int ret;
+
+        if (page < 0 || page >= fi->pg_count) {
+                return (-EADDR);
+        }
+	RT_LOCK(fi);
+#if AT45DB_USE_ERASE_MAP == 1
+	if (fi->em_known && (fi->em_known[page / 8] & (1 << (page % 8)))) {
+		// Page state known from erase or previous check.
+		ret = (em_erased(fi, page)) ? 0 : -EDATA;
+	} else {
+		ret = blank_check(fi, page);
+	}
+#else
+	ret = blank_check(fi, page);
+#endif
+	RT_EXIT(fi, AT45DB_API_CHECK_ERASED);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_block_erase
+ */
+int at45db_block_erase(at45db fi, int block)
+{
+        unsigned char cmd[] = {0x50, 0x00, 0x00, 0x00};
+	int ret;
+
+        if (block < 0 || block >= fi->bl_count) {
+                return (-EADDR);
+        }
+	switch (fi->pg_size) {
+	case 264 :
+	        cmd[1] = block >> 4;
+		cmd[2] = block << 4;
+		break;
+	case 1056 :
+	        cmd[1] = block >> 2;
+		cmd[2] = block << 6;
+		break;
+	default :
+		crit_err_exit(BAD_PARAMETER);
+		break;
+	}
+	RT_LOCK(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, block * (fi->pg_count / fi->bl_count), fi->pg_count / fi->bl_count))) {
+		goto exit;
+	}
+#endif
+	buf_inval(fi, block * (fi->pg_count / fi->bl_count), fi->pg_count / fi->bl_count);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+	ret = wait_op(fi, AT45DB_OP_BLOCK_ERASE);
+#if AT45DB_USE_ERASE_MAP == 1
+	page_mark(fi, block * (fi->pg_count / fi->bl_count), fi->pg_count / fi->bl_count,
+	        (ret == 0) ? TRUE : FALSE);
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, block * (fi->pg_count / fi->bl_count), fi->pg_count / fi->bl_count, TRUE);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_BLOCK_ERASE);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_chip_erase
+ */
+int at45db_chip_erase(at45db fi)
+{
+        unsigned char cmd[] = {0xC7, 0x94, 0x80, 0x9A};
+	int ret = 0;
+
+	RT_LOCK(fi);
+	buf_inval(fi, 0, fi->pg_count);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+#if AT45DB_USE_EXT_STAT == 1
+	unsigned int stat;
+        do {
+		vTaskDelay(RT_LEFT(fi, CHIP_ERASE_CHECK_RATE));
+		if (at45db_ext_stat(fi, &stat) != 0) {
+			ret = -EHW;
+			goto exit;
+		}
+		if (stat & AT45DB_PROG_ERR) {
+			ret = -EDATA;
+		}
+#if AT45DB_USE_RT == 1
+		if (!(stat & AT45DB_FLASH_READY2) && rt_expired(fi, rt_base(fi))) {
+			ret = -EHW;
+			break;
+		}
+#endif
+        } while (!(stat & AT45DB_FLASH_READY2));
+#else
+	unsigned char stat;
+        do {
+		vTaskDelay(RT_LEFT(fi, CHIP_ERASE_CHECK_RATE));
+		stat = 0xD7;
+                if (0 != trans(fi, &stat, 1, &stat, 1, FALSE)) {
+			ret = -EHW;
+			goto exit;
+		}
+#if AT45DB_USE_RT == 1
+		if (!(stat & AT45DB_FLASH_READY) && rt_expired(fi, rt_base(fi))) {
+			ret = -EHW;
+			break;
+		}
+#endif
+        } while (!(stat & AT45DB_FLASH_READY));
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+#if AT45DB_USE_PROTECT == 1
+	// Protected sectors are not erased.
+	for (int i = 0; i < fi->pg_count; i++) {
+		if (!prot_page(fi, i)) {
+			page_mark(fi, i, 1, (ret == 0) ? TRUE : FALSE);
+		}
+	}
+#else
+	page_mark(fi, 0, fi->pg_count, (ret == 0) ? TRUE : FALSE);
+#endif
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, 0, fi->pg_count, TRUE);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_CHIP_ERASE);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_section_erase
+ */
+int at45db_section_erase(at45db fi, int start, int end)
+{
+        int i, err = 0;
+
+        if (start >= end) {
+                return (-EADDR);
+        }
+        if (start < 0 || start > fi->pg_count - 2 || end >= fi->pg_count) {
+                return (-EADDR);
+        }
+	lock(fi);
+        for (i = start; i <= end; i++) {
+                if (0 != (err = at45db_page_erase(fi, i))) {
+			break;
+		}
+		// Erase map knows page erased now, check device.
+                if (0 != (err = blank_check(fi, i))) {
+                        break;
+                }
+        }
+	unlock(fi);
+        return (err);
+}
+
+/**
+ * at45db_read_cont
+ */
+int at45db_read_cont(at45db fi, enum at45db_read_cont_type type, unsigned char *buf, int page, int offs, int num)
+{
+        unsigned char cmd[] = {type, 0x00, 0x00, 0x00, 0xFF, 0xFF};
+	int cmd_sz = 0, ret = 0;
+
+	if (!create_address(fi, cmd, page, offs)) {
+		return (-EADDR);
+	}
+	switch (type) {
+	case AT45DB_READ_CONT_HF0 :
+		cmd_sz = 5;
+		break;
+	case AT45DB_READ_CONT_HF1 :
+		cmd_sz = 6;
+		break;
+	case AT45DB_READ_CONT_LF :
+		/* FALLTHRU */
+	case AT45DB_READ_CONT_LP :
+		cmd_sz = 4;
+		break;
+	default :
+		crit_err_exit(BAD_PARAMETER);
+		break;
+	}
+	RT_LOCK(fi);
+        if (0 != trans(fi, cmd, cmd_sz, buf, num, fi->use_dma)) {
+		ret = -EHW;
+	}
+	RT_EXIT(fi, AT45DB_API_READ_CONT);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_read_mod_write
+ */
+int at45db_read_mod_write(at45db fi, unsigned char *buf, int bfn, int page, int offs, int num)
+{
+        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	int ret;
+
+        if (bfn == 1) {
+                cmd[0] = 0x58;
+        } else if (bfn == 2) {
+                cmd[0] = 0x59;
+        } else {
+                crit_err_exit(BAD_PARAMETER);
+        }
+	if (!create_address(fi, cmd, page, offs)) {
+		return (-EADDR);
+	}
+	RT_LOCK(fi);
+#if AT45DB_USE_PROTECT == 1
+	if (0 != (ret = prot_check(fi, page, 1))) {
+		goto exit;
+	}
+#endif
+	buf_inval(fi, page, 1);
+	buf_set(fi, bfn, AT45DB_BUF_UNKNOWN, 0);
+        if (0 != trans(fi, cmd, sizeof(cmd), buf, num, fi->use_dma)) {
+		ret = -EHW;
+		goto exit;
+	}
+	ret = wait_op(fi, AT45DB_OP_RMW);
+#if AT45DB_USE_VERIFY == 1
+	if (ret == 0 && fi->vfy) {
+		ret = cmp_buf(fi, bfn, page);
+	}
+#endif
+	if (ret == 0) {
+		buf_set(fi, bfn, AT45DB_BUF_CLEAN, page);
+	}
+#if AT45DB_USE_ERASE_MAP == 1
+	if (num) {
+		// Auto page rewrite keeps page content and discard state.
+		page_mark(fi, page, 1, FALSE);
+	}
+#endif
+#if AT45DB_USE_WEAR == 1
+	wear_note(fi, page, 1, TRUE);
+#endif
+exit:
+	RT_EXIT(fi, AT45DB_API_RMW);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_pwr_down
+ */
+int at45db_pwr_down(at45db fi, enum at45db_pwr_down_type type)
+{
+	unsigned char cmd = type;
+	int ret = 0;
+
+	lock(fi);
+	switch (cmd) {
+	case AT45DB_ULTRA_DEEP_PWR_DOWN :
+		// Buffers content is lost.
+		buf_set(fi, 1, AT45DB_BUF_UNKNOWN, 0);
+		buf_set(fi, 2, AT45DB_BUF_UNKNOWN, 0);
+		/* FALLTHRU */
+	case AT45DB_DEEP_PWR_DOWN :
+		break;
+	default :
+		crit_err_exit(BAD_PARAMETER);
+		break;
+	}
+        if (0 != trans(fi, &cmd, 1, &cmd, 0, FALSE)) {
+		ret = -EHW;
+	}
+#if AT45DB_USE_PWR_MNG == 1
+	if (ret == 0) {
+		pm_set_state(fi, type);
+	}
+#endif
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_wake
+ */
+int at45db_wake(at45db fi)
+{
+	unsigned char cmd = 0xAB;
+	int ret = 0;
+
+	lock(fi);
+        if (0 != trans(fi, &cmd, 1, &cmd, 0, FALSE)) {
+		ret = -EHW;
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_set_page_size
+ */
+int at45db_set_page_size(at45db fi, enum at45db_page_size sz)
+{
+	unsigned char cmd[] = {0x3D, 0x2A, 0x80, 0x00};
+	int ret = 0;
+
+	if (sz != AT45DB_SET_PAGE_SIZE_PO2 && sz != AT45DB_SET_PAGE_SIZE_STD) {
+		crit_err_exit(BAD_PARAMETER);
+	}
+	cmd[3] = sz;
+	lock(fi);
+	buf_set(fi, 1, AT45DB_BUF_UNKNOWN, 0);
+	buf_set(fi, 2, AT45DB_BUF_UNKNOWN, 0);
+	if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
+		ret = -EHW;
+	}
+	unlock(fi);
+	return (ret);
+}
+
+#if AT45DB_USE_SVC == 1
+/**
+ * at45db_svc_start
+ */
+void at45db_svc_start(at45db fi, UBaseType_t prio)
+{
+	if (fi->mtx == NULL) {
+		if (NULL == (fi->mtx = xSemaphoreCreateRecursiveMutex())) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+#if AT45DB_USE_ERASE_AHEAD == 1
+	if (NULL == (fi->ea_dirty = pvPortMalloc(fi->pg_count / 8))) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	memset(fi->ea_dirty, 0, fi->pg_count / 8);
+	at45db_erase_map_init(fi);
+#endif
+	fi->last_use = xTaskGetTickCount();
+	if (pdPASS != xTaskCreate(svc_tsk, "AT45SVC", AT45DB_SVC_STACK_SIZE, fi,
+	                          prio, &fi->svc_tsk)) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+}
+
+/**
+ * svc_tsk
+ */
+static void svc_tsk(void *p)
+{
+	at45db fi = p;
+	TickType_t idle;
+	boolean_t work;
+#if AT45DB_USE_WEAR == 1
+	int bfn;
+#endif
+
+	for (;;) {
+#if AT45DB_USE_PWR_MNG == 1
+		if (fi->pm_tmo && !fi->pm_state && fi->pm_tmo < AT45DB_SVC_PERIOD) {
+			ulTaskNotifyTake(pdTRUE, fi->pm_tmo);
+		} else {
+			ulTaskNotifyTake(pdTRUE, AT45DB_SVC_PERIOD);
+		}
+#else
+		ulTaskNotifyTake(pdTRUE, AT45DB_SVC_PERIOD);
+#endif
+		do {
+			idle = xTaskGetTickCount() - fi->last_use;
+			if (idle < AT45DB_SVC_IDLE_TIME) {
+				vTaskDelay(AT45DB_SVC_IDLE_TIME - idle);
+				work = TRUE;
+				continue;
+			}
+			if (pdTRUE != xSemaphoreTakeRecursive(fi->mtx, 0)) {
+				vTaskDelay(AT45DB_SVC_IDLE_TIME);
+				work = TRUE;
+				continue;
+			}
+#if AT45DB_USE_RT == 1
+			if (fi->rt_busy) {
+				// Device can be busy after timeout, wait for at45db_busy().
+				xSemaphoreGiveRecursive(fi->mtx);
+				break;
+			}
+#endif
+			work = FALSE;
+#if AT45DB_USE_ERASE_AHEAD == 1
+			work |= ea_step(fi);
+#endif
+#if AT45DB_USE_REFRESH == 1
+			if (!work) {
+				work = rf_step(fi);
+			}
+#endif
+#if AT45DB_USE_WEAR == 1
+			if (!work && fi->wr_img && fi->wr_chg >= AT45DB_WEAR_SYNC_CNT &&
+			    0 != (bfn = svc_buf(fi, 1))) {
+				wear_store(fi, bfn);
+			}
+#endif
+#if AT45DB_USE_PWR_MNG == 1
+			if (!work && fi->pm_tmo && !fi->pm_state &&
+			    xTaskGetTickCount() - fi->last_use >= fi->pm_tmo) {
+				at45db_pwr_down(fi, fi->pm_type);
+			}
+#endif
+			xSemaphoreGiveRecursive(fi->mtx);
+		} while (work);
+	}
+}
+
+#if AT45DB_USE_REFRESH == 1 || AT45DB_USE_WEAR == 1
+/**
+ * svc_buf
+ */
+static int svc_buf(at45db fi, int bfn)
+{
+	// Use buffer without pending modification or staged data, prefer one
+	// without page mirror (buffer states are ordered unknown, clean, dirty).
+	if (fi->bufst[2 - bfn].state < fi->bufst[bfn - 1].state) {
+		bfn = 3 - bfn;
+	}
+	return ((fi->bufst[bfn - 1].state == AT45DB_BUF_DIRTY) ? 0 : bfn);
+}
+#endif
+#endif
+
+#if AT45DB_USE_ERASE_AHEAD == 1
+/**
+ * at45db_discard
+ */
+int at45db_discard(at45db fi, int start, int end)
+{
+	if (start > end || start < 0 || end >= fi->pg_count) {
+		return (-EADDR);
+	}
+	if (fi->ea_dirty == NULL) {
+		// Service task not started.
+		crit_err_exit(BAD_PARAMETER);
+	}
+	lock(fi);
+	for (int i = start; i <= end; i++) {
+		if (!em_erased(fi, i)) {
+			fi->ea_dirty[i / 8] |= 1 << (i % 8);
+		}
+	}
+	unlock(fi);
+	xTaskNotifyGive(fi->svc_tsk);
+	return (0);
+}
+
+/**
+ * ea_step
+ */
+static boolean_t ea_step(at45db fi)
+{
+	int n = fi->pg_count / 8, ppb = fi->pg_count / fi->bl_count;
+	int i, pg;
+
+	for (i = 0; i < n; i++) {
+		if (fi->ea_dirty[fi->ea_cursor]) {
+			break;
+		}
+		if (++fi->ea_cursor == n) {
+			fi->ea_cursor = 0;
+		}
+	}
+	if (i == n) {
+		return (FALSE);
+	}
+	// Bitmap byte covers one block when block has 8 pages.
+	if (ppb == 8 && fi->ea_dirty[fi->ea_cursor] == 0xFF) {
+		if (0 != at45db_block_erase(fi, fi->ea_cursor)) {
+			fi->ea_dirty[fi->ea_cursor] = 0;
+		}
+		return (TRUE);
+	}
+	for (i = 0; i < 8; i++) {
+		if (fi->ea_dirty[fi->ea_cursor] & (1 << i)) {
+			break;
+		}
+	}
+	pg = fi->ea_cursor * 8 + i;
+	if (0 != at45db_page_erase(fi, pg)) {
+		fi->ea_dirty[fi->ea_cursor] &= ~(1 << i);
+	}
+	return (TRUE);
+}
+
+#endif
+
+#if AT45DB_USE_ERASE_MAP == 1
+/**
+ * at45db_erase_map_init
+ */
+void at45db_erase_map_init(at45db fi)
+{
+	lock(fi);
+	if (fi->em_known == NULL) {
+		if (NULL == (fi->em_known = pvPortMalloc(fi->pg_count / 8))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		if (NULL == (fi->em_blank = pvPortMalloc(fi->pg_count / 8))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	memset(fi->em_known, 0, fi->pg_count / 8);
+	memset(fi->em_blank, 0, fi->pg_count / 8);
+	unlock(fi);
+}
+
+/**
+ * em_erased
+ */
+static boolean_t em_erased(at45db fi, int page)
+{
+	if (fi->em_known == NULL) {
+		return (FALSE);
+	}
+	return ((fi->em_known[page / 8] & fi->em_blank[page / 8] & (1 << (page % 8))) ? TRUE : FALSE);
+}
+
+/**
+ * em_mark
+ */
+static void em_mark(at45db fi, int page, int num, boolean_t erased)
+{
+	if (fi->em_known == NULL) {
+		return;
+	}
+	for (int i = page; i < page + num; i++) {
+		fi->em_known[i / 8] |= 1 << (i % 8);
+		if (erased) {
+			fi->em_blank[i / 8] |= 1 << (i % 8);
+		} else {
+			fi->em_blank[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+}
+
+/**
+ * em_forget
+ */
+static void em_forget(at45db fi, int page, int num)
+{
+	if (fi->em_known == NULL) {
+		return;
+	}
+	for (int i = page; i < page + num; i++) {
+		fi->em_known[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+/**
+ * page_mark
+ */
+static void page_mark(at45db fi, int page, int num, boolean_t erased)
+{
+#if AT45DB_USE_ERASE_AHEAD == 1
+	if (fi->ea_dirty) {
+		// Programmed or erased page is not discarded anymore.
+		for (int i = page; i < page + num; i++) {
+			fi->ea_dirty[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+#endif
+	if (erased) {
+		em_mark(fi, page, num, TRUE);
+	} else {
+		// Programmed data or failed erase can be blank or not.
+		em_forget(fi, page, num);
+	}
+}
+#endif
+
+#if AT45DB_USE_PWR_MNG == 1
+/**
+ * at45db_pwr_mng
+ */
+void at45db_pwr_mng(at45db fi, enum at45db_pwr_down_type type, TickType_t tmo)
+{
+	if (type != AT45DB_DEEP_PWR_DOWN && type != AT45DB_ULTRA_DEEP_PWR_DOWN) {
+		crit_err_exit(BAD_PARAMETER);
+	}
+	lock(fi);
+	fi->pm_type = type;
+	fi->pm_tmo = tmo;
+	unlock(fi);
+	if (fi->svc_tsk) {
+		xTaskNotifyGive(fi->svc_tsk);
+	}
+}
+
+/**
+ * at45db_pwr_stat
+ */
+void at45db_pwr_stat(at45db fi, struct at45db_pwr_stat *st)
+{
+	unsigned int t;
+
+	taskENTER_CRITICAL();
+	*st = fi->pm_stat;
+	t = (xTaskGetTickCount() - fi->pm_since) * portTICK_PERIOD_MS;
+	switch (fi->pm_state) {
+	case AT45DB_DEEP_PWR_DOWN :
+		st->dpd_ms += t;
+		break;
+	case AT45DB_ULTRA_DEEP_PWR_DOWN :
+		st->udpd_ms += t;
+		break;
+	default :
+		st->active_ms += t;
+		break;
+	}
+	taskEXIT_CRITICAL();
+	st->energy_uj = ((uint64_t) st->active_ms * AT45DB_STBY_CURR_NA +
+	                 (uint64_t) st->dpd_ms * AT45DB_DPD_CURR_NA +
+	                 (uint64_t) st->udpd_ms * AT45DB_UDPD_CURR_NA) *
+	                AT45DB_VCC_MV / 1000000000;
+}
+
+/**
+ * pm_set_state
+ */
+static void pm_set_state(at45db fi, unsigned char state)
+{
+	TickType_t now = xTaskGetTickCount();
+	unsigned int t = (now - fi->pm_since) * portTICK_PERIOD_MS;
+
+	taskENTER_CRITICAL();
+	switch (fi->pm_state) {
+	case AT45DB_DEEP_PWR_DOWN :
+		fi->pm_stat.dpd_ms += t;
+		break;
+	case AT45DB_ULTRA_DEEP_PWR_DOWN :
+		fi->pm_stat.udpd_ms += t;
+		break;
+	default :
+		fi->pm_stat.active_ms += t;
+		break;
+	}
+	fi->pm_state = state;
+	fi->pm_since = now;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * pm_wake
+ */
+static int pm_wake(at45db fi)
+{
+	unsigned char cmd = 0xAB;
+	TickType_t t;
+
+	t = xTaskGetTickCount();
+	if (0 != trans(fi, &cmd, 1, &cmd, 0, FALSE)) {
+		return (-EHW);
+	}
+	if (fi->pm_state == AT45DB_ULTRA_DEEP_PWR_DOWN) {
+		vTaskDelay(AT45DB_XUDPD_TIME);
+	} else {
+		vTaskDelay(AT45DB_RDPD_TIME);
+	}
+	pm_set_state(fi, 0);
+	fi->pm_stat.wakes++;
+	fi->pm_stat.wake_ms += (xTaskGetTickCount() - t) * portTICK_PERIOD_MS;
+	return (0);
+}
+#endif
+
+#if AT45DB_USE_REFRESH == 1
+/**
+ * at45db_refresh_enable
+ */
+void at45db_refresh_enable(at45db fi, boolean_t en)
+{
+	lock(fi);
+	fi->rf_en = en;
+	fi->rf_budget = 0;
+	fi->rf_base = 0;
+	fi->rf_time = xTaskGetTickCount();
+	unlock(fi);
+	if (en && fi->svc_tsk) {
+		xTaskNotifyGive(fi->svc_tsk);
+	}
+}
+
+/**
+ * rf_step
+ */
+static boolean_t rf_step(at45db fi)
+{
+#if AT45DB_USE_WEAR == 1
+	int pps = fi->pg_count / AT45DB_SECT_COUNT;
+#endif
+	boolean_t skip = FALSE;
+	TickType_t t;
+	int n, bfn, ret;
+
+	if (!fi->rf_en) {
+		return (FALSE);
+	}
+	t = xTaskGetTickCount();
+	if ((n = (t - fi->rf_time) / AT45DB_REFRESH_PERIOD) > 0) {
+		fi->rf_time += n * AT45DB_REFRESH_PERIOD;
+		fi->rf_budget += n * AT45DB_REFRESH_PAGES;
+		if (fi->rf_budget > AT45DB_REFRESH_PAGES) {
+			fi->rf_budget = AT45DB_REFRESH_PAGES;
+		}
+	}
+	if (fi->rf_budget == 0) {
+		return (FALSE);
+	}
+	if (0 == (bfn = svc_buf(fi, AT45DB_REFRESH_BUF))) {
+		return (FALSE);
+	}
+#if AT45DB_USE_WEAR == 1
+	if (fi->wr_img && fi->rf_page % pps == 0) {
+		// Sector start, move sweep to sector with exceeded limit unless
+		// entered sector exceeded it. Started sector is always finished.
+		if (fi->wr_img[WEAR_SPROG_IDX + fi->rf_page / pps] < AT45DB_REFRESH_LIMIT) {
+			for (int s = 0; s < AT45DB_SECT_COUNT; s++) {
+				if (fi->wr_img[WEAR_SPROG_IDX + s] >= AT45DB_REFRESH_LIMIT) {
+					fi->rf_page = s * pps;
+					break;
+				}
+			}
+		}
+		fi->rf_base = fi->wr_img[WEAR_SPROG_IDX + fi->rf_page / pps];
+	}
+#endif
+#if AT45DB_USE_ERASE_AHEAD == 1
+	// Discarded page is erased by erase-ahead.
+	skip = (fi->ea_dirty && (fi->ea_dirty[fi->rf_page / 8] & (1 << (fi->rf_page % 8)))) ?
+	       TRUE : FALSE;
+#endif
+	// Auto page rewrite (Read-Modify-Write without data).
+	if (!skip && 0 != (ret = at45db_read_mod_write(fi, NULL, bfn, fi->rf_page, 0, 0)) &&
+	    ret != -EADDR) {
+		// Page is retried in next period, protected page is skipped.
+		fi->rf_budget = 0;
+		return (FALSE);
+	}
+	fi->rf_budget--;
+#if AT45DB_USE_WEAR == 1
+	if (fi->wr_img && fi->rf_page % pps == pps - 1) {
+		// Sector rewritten, keep programs counted since sweep entered sector.
+		if (fi->wr_img[WEAR_SPROG_IDX + fi->rf_page / pps] >= fi->rf_base) {
+			fi->wr_img[WEAR_SPROG_IDX + fi->rf_page / pps] -= fi->rf_base;
+			fi->wr_chg++;
+		}
+		fi->rf_base = 0;
+	}
+#endif
+	if (++fi->rf_page == fi->pg_count) {
+		fi->rf_page = 0;
+	}
+	return ((fi->rf_budget > 0) ? TRUE : FALSE);
+}
+#endif
+
+#if AT45DB_USE_WEAR == 1
+/**
+ * at45db_wear_init
+ */
+int at45db_wear_init(at45db fi, int page)
+{
+	uint32_t hdr[3];
+	uint32_t *img;
+	int sz = wear_img_size(fi), slp = wear_slot_pages(fi);
+	int ret, slot = -1;
+	uint32_t seq = 0;
+
+	if (page < 0 || page + 2 * slp > fi->pg_count) {
+		return (-EADDR);
+	}
+	if (NULL == (img = pvPortMalloc(sz))) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	lock(fi);
+	fi->wr_page = page;
+	// Find valid slot with highest sequence number.
+	for (int i = 0; i < 2; i++) {
+		if (0 != (ret = at45db_read_mem(fi, (unsigned char *) hdr, page + i * slp, 0,
+		                                sizeof(hdr)))) {
+			goto exit;
+		}
+		if (hdr[WEAR_MAGIC_IDX] != WEAR_MAGIC || (slot >= 0 && hdr[WEAR_SEQ_IDX] < seq)) {
+			continue;
+		}
+		if (0 != (ret = at45db_read_cont(fi, AT45DB_READ_CONT_HF0, (unsigned char *) img,
+		                                 page + i * slp, 0, sz))) {
+			goto exit;
+		}
+		if (img[WEAR_CRC_IDX] == crc_ccit(INIT_CRC_CCITT, (unsigned char *) (img + WEAR_SPROG_IDX),
+		                                  sz - WEAR_SPROG_IDX * sizeof(uint32_t))) {
+			slot = i;
+			seq = hdr[WEAR_SEQ_IDX];
+		}
+	}
+	if (slot < 0) {
+		memset(img, 0, sz);
+		img[WEAR_MAGIC_IDX] = WEAR_MAGIC;
+	} else if (slot == 0) {
+		// Reload winning slot (buffer contains slot 1 or slot 0 data).
+		if (0 != (ret = at45db_read_cont(fi, AT45DB_READ_CONT_HF0, (unsigned char *) img,
+		                                 page, 0, sz))) {
+			goto exit;
+		}
+	}
+	fi->wr_slot = (slot < 0) ? 1 : slot;
+	fi->wr_chg = 0;
+	if (fi->wr_img) {
+		// Repeated init, counters are reloaded.
+		vPortFree(fi->wr_img);
+	}
+	fi->wr_img = img;
+exit:
+	unlock(fi);
+	if (ret) {
+		vPortFree(img);
+	}
+	return (ret);
+}
+
+/**
+ * at45db_wear_sync
+ */
+int at45db_wear_sync(at45db fi)
+{
+	int ret;
+
+	lock(fi);
+	ret = wear_store(fi, 1);
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * wear_store
+ */
+static int wear_store(at45db fi, int bfn)
+{
+	uint32_t *img = fi->wr_img;
+	int sz = wear_img_size(fi), slot, pg, n = 0;
+	int ret = 0;
+
+	if (img == NULL || fi->wr_chg == 0) {
+		return (0);
+	}
+	slot = fi->wr_slot ^ 1;
+	pg = fi->wr_page + slot * wear_slot_pages(fi);
+	img[WEAR_SEQ_IDX]++;
+	img[WEAR_CRC_IDX] = crc_ccit(INIT_CRC_CCITT, (unsigned char *) (img + WEAR_SPROG_IDX),
+	                             sz - WEAR_SPROG_IDX * sizeof(uint32_t));
+	// Image must not change while written, its own programs are counted after.
+	fi->wr_img = NULL;
+	for (int offs = 0; offs < sz; offs += fi->pg_size, n++) {
+		if (0 != (ret = at45db_write_mem(fi, (unsigned char *) img + offs, bfn, pg + n, 0,
+		                                 (sz - offs < fi->pg_size) ? sz - offs : fi->pg_size))) {
+			break;
+		}
+	}
+	fi->wr_img = img;
+	for (int i = 0; i < n; i++) {
+		wear_note(fi, pg + i, 1, TRUE);
+	}
+	if (ret == 0) {
+		// Counts of image programs are stored by next sync.
+		fi->wr_slot = slot;
+		fi->wr_chg = 0;
+	}
+	return (ret);
+}
+
+/**
+ * at45db_wear_area_pages
+ */
+int at45db_wear_area_pages(at45db fi)
+{
+	return (2 * wear_slot_pages(fi));
+}
+
+/**
+ * at45db_wear_hot
+ */
+int at45db_wear_hot(at45db fi, struct at45db_wear_hot *hot, int num)
+{
+	uint32_t *ec;
+	int n = 0, j;
+
+	if (fi->wr_img == NULL || num <= 0) {
+		return (0);
+	}
+	lock(fi);
+	ec = fi->wr_img + WEAR_ERASE_IDX;
+	// Insert sort of blocks by erase count, descending.
+	for (int i = 0; i < fi->bl_count; i++) {
+		if (n == num && ec[i] <= hot[n - 1].cnt) {
+			continue;
+		}
+		j = (n < num) ? n++ : n - 1;
+		for (; j > 0 && hot[j - 1].cnt < ec[i]; j--) {
+			hot[j] = hot[j - 1];
+		}
+		hot[j].block = i;
+		hot[j].cnt = ec[i];
+	}
+	unlock(fi);
+	return (n);
+}
+
+/**
+ * at45db_wear_sect_prog
+ */
+unsigned int at45db_wear_sect_prog(at45db fi, int sect)
+{
+	if (fi->wr_img == NULL || sect < 0 || sect >= AT45DB_SECT_COUNT) {
+		return (0);
+	}
+	return (fi->wr_img[WEAR_SPROG_IDX + sect]);
+}
+
+/**
+ * at45db_sect_refresh
+ */
+int at45db_sect_refresh(at45db fi, int sect)
+{
+	int pps = fi->pg_count / AT45DB_SECT_COUNT;
+	int ret = 0;
+
+	if (sect < 0 || sect >= AT45DB_SECT_COUNT) {
+		return (-EADDR);
+	}
+	lock(fi);
+	for (int i = sect * pps; i < (sect + 1) * pps; i++) {
+		// Auto page rewrite (Read-Modify-Write without data).
+		if (0 != (ret = at45db_read_mod_write(fi, NULL, 1, i, 0, 0))) {
+			break;
+		}
+	}
+	if (ret == 0 && fi->wr_img) {
+		fi->wr_img[WEAR_SPROG_IDX + sect] = 0;
+		fi->wr_chg++;
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * wear_note
+ */
+static void wear_note(at45db fi, int page, int num, boolean_t erase)
+{
+	int ppb = fi->pg_count / fi->bl_count, pps = fi->pg_count / AT45DB_SECT_COUNT;
+
+	if (fi->wr_img == NULL) {
+		return;
+	}
+	if (erase) {
+		for (int b = page / ppb; b <= (page + num - 1) / ppb; b++) {
+			fi->wr_img[WEAR_ERASE_IDX + b]++;
+		}
+	}
+	for (int s = page / pps; s <= (page + num - 1) / pps; s++) {
+		fi->wr_img[WEAR_SPROG_IDX + s] += (num < pps) ? num : pps;
+	}
+	fi->wr_chg++;
+}
+
+/**
+ * wear_slot_pages
+ */
+static int wear_slot_pages(at45db fi)
+{
+	return ((wear_img_size(fi) + fi->pg_size - 1) / fi->pg_size);
+}
+#endif
+
+#if AT45DB_USE_PROTECT == 1
+/**
+ * at45db_prot_load
+ */
+int at45db_prot_load(at45db fi)
+{
+	unsigned char cmd[] = {0x32, 0xFF, 0xFF, 0xFF};
+	unsigned int stat;
+	int ret;
+
+	lock(fi);
+	fi->prot_valid = FALSE;
+	if (0 != (ret = at45db_stat(fi, &stat))) {
+		goto exit;
+	}
+	if (0 != trans(fi, cmd, sizeof(cmd), fi->prot_reg, AT45DB_SECT_COUNT, FALSE)) {
+		ret = -EHW;
+		goto exit;
+	}
+	cmd[0] = 0x35;
+	if (0 != trans(fi, cmd, sizeof(cmd), fi->lock_reg, AT45DB_SECT_COUNT, FALSE)) {
+		ret = -EHW;
+		goto exit;
+	}
+	fi->prot_en = (stat & AT45DB_PROTECT_ENABLED) ? TRUE : FALSE;
+	fi->prot_valid = TRUE;
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_prot_enable
+ */
+int at45db_prot_enable(at45db fi, boolean_t en)
+{
+	int ret;
+
+	lock(fi);
+	if (0 == (ret = prot_cmd(fi, (en) ? 0xA9 : 0x9A, NULL, 0))) {
+		fi->prot_en = en;
+	} else {
+		fi->prot_valid = FALSE;
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_prot_set
+ */
+int at45db_prot_set(at45db fi, unsigned char *reg)
+{
+	int ret;
+
+	lock(fi);
+	fi->prot_valid = FALSE;
+	// Register commands use flash buffer 1.
+	buf_set(fi, 1, AT45DB_BUF_UNKNOWN, 0);
+	// Erase sector protection register.
+	if (0 != (ret = prot_cmd(fi, 0xCF, NULL, 0))) {
+		goto exit;
+	}
+	vTaskDelay(AT45DB_PAGE_ERASE_TIME);
+	if (0 != (ret = wait_ready(fi))) {
+		goto exit;
+	}
+	// Program sector protection register.
+	if (0 != (ret = prot_cmd(fi, 0xFC, reg, AT45DB_SECT_COUNT))) {
+		goto exit;
+	}
+	if (0 != (ret = wait_ready(fi))) {
+		goto exit;
+	}
+	ret = at45db_prot_load(fi);
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_prot_get
+ */
+int at45db_prot_get(at45db fi, unsigned char *reg, boolean_t *en)
+{
+	int ret = 0;
+
+	lock(fi);
+	if (fi->prot_valid || 0 == (ret = at45db_prot_load(fi))) {
+		memcpy(reg, fi->prot_reg, AT45DB_SECT_COUNT);
+		if (en) {
+			*en = fi->prot_en;
+		}
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_sect_lockdown
+ */
+int at45db_sect_lockdown(at45db fi, int page)
+{
+	unsigned char cmd[] = {0x3D, 0x2A, 0x7F, 0x30, 0x00, 0x00, 0x00};
+	int ret;
+
+	if (!create_address(fi, cmd + 3, page, 0)) {
+		return (-EADDR);
+	}
+	lock(fi);
+	fi->prot_valid = FALSE;
+	// Lockdown command uses flash buffer 1.
+	buf_set(fi, 1, AT45DB_BUF_UNKNOWN, 0);
+	if (0 != trans(fi, cmd, 1, cmd + 1, 6, FALSE)) {
+		ret = -EHW;
+		goto exit;
+	}
+	if (0 != (ret = wait_ready(fi))) {
+		goto exit;
+	}
+	ret = at45db_prot_load(fi);
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_secreg_read
+ */
+int at45db_secreg_read(at45db fi, unsigned char *buf, int offs, int num)
+{
+	unsigned char cmd[] = {0x77, 0xFF, 0xFF, 0xFF};
+	unsigned char tmp[AT45DB_SECREG_SIZE];
+	int ret = 0;
+
+	if (offs < 0 || num < 0 || offs + num > AT45DB_SECREG_SIZE) {
+		return (-EADDR);
+	}
+	lock(fi);
+	// Register is always read from its beginning.
+	if (0 != trans(fi, cmd, sizeof(cmd), tmp, offs + num, FALSE)) {
+		ret = -EHW;
+	} else {
+		memcpy(buf, tmp + offs, num);
+	}
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * at45db_secreg_write
+ */
+int at45db_secreg_write(at45db fi, unsigned char *buf)
+{
+	unsigned char cmd[] = {0x9B, 0x00, 0x00, 0x00};
+	int ret;
+
+	lock(fi);
+	// Register program uses flash buffer 1.
+	buf_set(fi, 1, AT45DB_BUF_UNKNOWN, 0);
+	if (0 != trans(fi, cmd, sizeof(cmd), buf, AT45DB_SECREG_USER_SIZE, FALSE)) {
+		ret = -EHW;
+		goto exit;
+	}
+	vTaskDelay(AT45DB_PAGE_ERASE_TIME);
+	ret = wait_ready(fi);
+exit:
+	unlock(fi);
+	return (ret);
+}
+
+/**
+ * prot_cmd
+ */
+static int prot_cmd(at45db fi, unsigned char op, unsigned char *data, int num)
+{
+	unsigned char cmd[] = {0x3D, 0x2A, 0x7F, op};
+
+	if (0 != trans(fi, cmd, sizeof(cmd), data, num, FALSE)) {
+		return (-EHW);
+	}
+	return (0);
+}
+
+/**
+ * prot_check
+ */
+static int prot_check(at45db fi, int page, int num)
+{
+	int ret;
+
+	if (!fi->prot_valid && 0 != (ret = at45db_prot_load(fi))) {
+		return (ret);
+	}
+	for (int i = page; i < page + num; i++) {
+		if (prot_page(fi, i)) {
+			return (-EADDR);
+		}
+	}
+	return (0);
+}
+
+/**
+ * prot_page
+ */
+static boolean_t prot_page(at45db fi, int page)
+{
+	int sect = page / (fi->pg_count / AT45DB_SECT_COUNT);
+	unsigned char m = 0xFF;
+
+	if (sect == 0) {
+		// Sector 0a is first block, sector 0b rest of sector 0.
+		m = (page < fi->pg_count / fi->bl_count) ? 0xC0 : 0x30;
+	}
+	if (fi->lock_reg[sect] & m) {
+		return (TRUE);
+	}
+	return ((fi->prot_en && (fi->prot_reg[sect] & m)) ? TRUE : FALSE);
+}
+#endif
+
+#if AT45DB_USE_READ_AHEAD == 1
+/**
+ * at45db_read_ahead
+ */
+void at45db_read_ahead(at45db fi, int pages)
+{
+	lock(fi);
+	if (fi->ra_cache) {
+		vPortFree(fi->ra_cache);
+		fi->ra_cache = NULL;
+	}
+	fi->ra_pages = fi->ra_num = fi->ra_run = 0;
+	fi->ra_last = -1;
+	if (pages > 0) {
+		if (NULL == (fi->ra_cache = pvPortMalloc(pages * fi->pg_size))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		fi->ra_pages = pages;
+	}
+	unlock(fi);
+}
+
+/**
+ * ra_read
+ */
+static int ra_read(at45db fi, unsigned char *buf, int page, int offs, int num)
+{
+	unsigned char cmd[] = {AT45DB_READ_CONT_HF0, 0x00, 0x00, 0x00, 0xFF};
+	int n;
+
+	if (page != fi->ra_last) {
+		fi->ra_run = (page == fi->ra_last + 1) ? fi->ra_run + 1 : 0;
+		fi->ra_last = page;
+	}
+	if (offs + num > fi->pg_size) {
+		return (0);
+	}
+	if (!fi->ra_num || page < fi->ra_first || page >= fi->ra_first + fi->ra_num) {
+		if (fi->ra_run < AT45DB_READ_AHEAD_TRIG) {
+			return (0);
+		}
+		// Sequential reader, fetch next pages by one continuous read.
+		n = (fi->pg_count - page < fi->ra_pages) ? fi->pg_count - page : fi->ra_pages;
+		fi->ra_num = 0;
+		create_address(fi, cmd, page, 0);
+		if (0 != trans(fi, cmd, sizeof(cmd), fi->ra_cache, n * fi->pg_size, fi->use_dma)) {
+			return (-EHW);
+		}
+		fi->ra_first = page;
+		fi->ra_num = n;
+	}
+	memcpy(buf, fi->ra_cache + (page - fi->ra_first) * fi->pg_size + offs, num);
+	return (1);
+}
+#endif
+
+#if AT45DB_USE_TRACE == 1
+/**
+ * at45db_trace_start
+ */
+void at45db_trace_start(at45db fi, int size)
+{
+	lock(fi);
+	if (fi->tr_buf) {
+		vPortFree(fi->tr_buf);
+		fi->tr_buf = NULL;
+	}
+	fi->tr_size = fi->tr_head = fi->tr_num = 0;
+	fi->tr_lost = 0;
+	if (size > 0) {
+		if (NULL == (fi->tr_buf = pvPortMalloc(size * sizeof(struct at45db_trace_rec)))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		fi->tr_size = size;
+	}
+	unlock(fi);
+}
+
+/**
+ * at45db_trace_read
+ */
+int at45db_trace_read(at45db fi, struct at45db_trace_rec *rec, int num, unsigned int *lost)
+{
+	int i, n;
+
+	lock(fi);
+	n = (num < fi->tr_num) ? num : fi->tr_num;
+	i = (fi->tr_head + fi->tr_size - fi->tr_num) % ((fi->tr_size) ? fi->tr_size : 1);
+	for (int j = 0; j < n; j++) {
+		rec[j] = fi->tr_buf[i];
+		if (++i == fi->tr_size) {
+			i = 0;
+		}
+	}
+	fi->tr_num -= n;
+	if (lost) {
+		*lost = fi->tr_lost;
+	}
+	fi->tr_lost = 0;
+	unlock(fi);
+	return (n);
+}
+#endif
+
+/**
+ * at45db_lock
+ */
+void at45db_lock(at45db fi)
+{
+	lock(fi);
+}
+
+/**
+ * at45db_unlock
+ */
+void at45db_unlock(at45db fi)
+{
+	unlock(fi);
+}
+
+/**
+ * lock
+ */
+static void lock(at45db fi)
+{
+	lock_tmo(fi, portMAX_DELAY);
+}
+
+/**
+ * lock_tmo
+ */
+static boolean_t lock_tmo(at45db fi, TickType_t tmo)
+{
+	if (fi->mtx && pdTRUE != xSemaphoreTakeRecursive(fi->mtx, tmo)) {
+		return (FALSE);
+	}
+#if AT45DB_USE_SVC == 1
+	if (xTaskGetCurrentTaskHandle() != fi->svc_tsk) {
+		fi->last_use = xTaskGetTickCount();
+	}
+#endif
+#if AT45DB_USE_PWR_MNG == 1
+	if (fi->pm_state) {
+		pm_wake(fi);
+	}
+#endif
+	return (TRUE);
+}
+
+/**
+ * unlock
+ */
+static void unlock(at45db fi)
+{
+#if AT45DB_USE_SVC == 1
+	if (xTaskGetCurrentTaskHandle() != fi->svc_tsk) {
+		fi->last_use = xTaskGetTickCount();
+	}
+#endif
+	if (fi->mtx) {
+		xSemaphoreGiveRecursive(fi->mtx);
+	}
+}
+
+/**
+ * at45db_buf_state
+ */
+enum at45db_buf_state at45db_buf_state(at45db fi, int bfn, int *page)
+{
+	enum at45db_buf_state st;
+
+	if (bfn != 1 && bfn != 2) {
+		crit_err_exit(BAD_PARAMETER);
+	}
+	lock(fi);
+	st = fi->bufst[bfn - 1].state;
+	if (page) {
+		*page = fi->bufst[bfn - 1].page;
+	}
+	unlock(fi);
+	return (st);
+}
+
+/**
+ * buf_set
+ */
+static void buf_set(at45db fi, int bfn, enum at45db_buf_state state, int page)
+{
+	fi->bufst[bfn - 1].state = state;
+	fi->bufst[bfn - 1].page = page;
+	fi->bufst[bfn - 1].ff = FALSE;
+}
+
+/**
+ * buf_inval
+ */
+static void buf_inval(at45db fi, int page, int num)
+{
+	for (int i = 0; i < 2; i++) {
+		if (fi->bufst[i].state != AT45DB_BUF_UNKNOWN &&
+		    fi->bufst[i].page >= page && fi->bufst[i].page < page + num) {
+			fi->bufst[i].state = AT45DB_BUF_UNKNOWN;
+		}
+	}
+#if AT45DB_USE_READ_AHEAD == 1
+	if (fi->ra_num && page < fi->ra_first + fi->ra_num && page + num > fi->ra_first) {
+		fi->ra_num = 0;
+	}
+#endif
+}
+
+#if AT45DB_USE_TIMING == 1
+/**
+ * at45db_detect
+ */
+int at45db_detect(at45db fi, enum at45db_part *part)
+{
+	unsigned char cmd = 0x9F;
+	unsigned char id[5];
+	enum at45db_part p = AT45DB_PART_UNKNOWN;
+	int ret = 0;
+
+	lock(fi);
+	if (0 != trans(fi, &cmd, 1, id, sizeof(id), FALSE)) {
+		ret = -EHW;
+		goto exit;
+	}
+	if (id[0] == 0x1F && id[1] == 0x28) {
+		// Extended device information string length.
+		p = (id[4] == 0x01) ? AT45DB_PART_641E : AT45DB_PART_642D;
+	} else if (fi->pg_size == 1056) {
+		// AT45DB642 does not support manufacturer and device ID read.
+		p = AT45DB_PART_642;
+	}
+	for (unsigned int i = 0; i < sizeof(part_prof) / sizeof(part_prof[0]); i++) {
+		if (part_prof[i].part == p) {
+			for (int j = 0; j < AT45DB_OP_COUNT; j++) {
+				fi->tm_est[j] = part_prof[i].tm_ms[j] * TM_SCALE / portTICK_PERIOD_MS;
+			}
+		}
+	}
+	if (part) {
+		*part = p;
+	}
+exit:
+	unlock(fi);
+	return (ret);
 }
 
 /**
- * at45db_write_buf
+ * at45db_op_time
  */
-int at45db_write_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num)
+TickType_t at45db_op_time(at45db fi, enum at45db_op op)
 {
-        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
-
-        if (bfn == 1) {
-                cmd[0] = 0x84;
-        } else if (bfn == 2) {
-                cmd[0] = 0x87;
-        } else {
-                crit_err_exit(BAD_PARAMETER);
-        }
-	if (!create_address(fi, cmd, 0, offs)) {
-		return (-EADDR);
-	}
-        if (bfn == 2) {
-                fi->buf2_ff = FALSE;
-        }
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd), buf, num,
-			   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-                  return (-EHW);
+	if (fi->tm_est[op] == 0) {
+		return (op_dflt_time(op));
 	}
-        return (0);
+	return (fi->tm_est[op] / TM_SCALE);
 }
 
 /**
- * at45db_store_buf
+ * at45db_set_op_time
  */
-int at45db_store_buf(at45db fi, int bfn, int page, boolean_t erase)
+void at45db_set_op_time(at45db fi, enum at45db_op op, TickType_t t)
 {
-        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	lock(fi);
+	fi->tm_est[op] = t * TM_SCALE;
+	unlock(fi);
+}
+#endif
 
-        if (bfn == 1) {
-                if (erase) {
-                        cmd[0] = 0x83;
-                } else {
-                        cmd[0] = 0x88;
-                }
-        } else if (bfn == 2) {
-                if (erase) {
-                        cmd[0] = 0x86;
-                } else {
-                        cmd[0] = 0x89;
-                }
-        } else {
-                crit_err_exit(BAD_PARAMETER);
-        }
-	if (!create_address(fi, cmd, page, 0)) {
-		return (-EADDR);
+/**
+ * wait_op
+ */
+static int wait_op(at45db fi, enum at45db_op op)
+{
+#if AT45DB_USE_TIMING == 1
+	TickType_t t0 = xTaskGetTickCount();
+	int d, ret;
+
+	if (fi->tm_est[op] == 0) {
+		fi->tm_est[op] = op_dflt_time(op) * TM_SCALE;
 	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-			   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	// Sleep slightly less than estimated time, then poll status.
+	if ((d = RT_LEFT(fi, fi->tm_est[op] * 7 / 8 / TM_SCALE)) > 0) {
+		vTaskDelay(d);
+	}
+	if (0 == (ret = wait_ready(fi))) {
+		d = (xTaskGetTickCount() - t0) * TM_SCALE;
+		fi->tm_est[op] += (d - (int) fi->tm_est[op]) / 8;
+		if (fi->tm_est[op] == 0) {
+			fi->tm_est[op] = 1;
+		}
+	}
+	return (ret);
+#else
+	TickType_t t = RT_LEFT(fi, op_dflt_time(op));
+
+	if (t) {
+		vTaskDelay(t);
 	}
-        if (erase) {
-                vTaskDelay(AT45DB_PAGE_ERASE_TIME);
-        }
 	return (wait_ready(fi));
+#endif
 }
 
 /**
- * at45db_load_buf
+ * op_dflt_time
  */
-int at45db_load_buf(at45db fi, int bfn, int page)
+static TickType_t op_dflt_time(enum at45db_op op)
 {
-        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
-        unsigned char stat;
-
-        if (bfn == 1) {
-                cmd[0] = 0x53;
-        } else if (bfn == 2) {
-                cmd[0] = 0x55;
-        } else {
-                crit_err_exit(BAD_PARAMETER);
-        }
-	if (!create_address(fi, cmd, page, 0)) {
-		return (-EADDR);
-	}
-        if (bfn == 2) {
-                fi->buf2_ff = FALSE;
-        }
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-			   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	switch (op) {
+	case AT45DB_OP_PAGE_ERASE_PROG :
+		/* FALLTHRU */
+	case AT45DB_OP_PAGE_ERASE :
+		return (AT45DB_PAGE_ERASE_TIME);
+	case AT45DB_OP_BLOCK_ERASE :
+		return (AT45DB_BLOCK_ERASE_TIME);
+	case AT45DB_OP_RMW :
+		return (AT45DB_PAGE_ERASE_PROG_TIME);
+	default :
+		return (0);
 	}
-        do {
-		taskYIELD();
-                stat = 0xD7;
-                if (0 != spi_trans(fi->spi, &fi->csel, &stat, 1, &stat, 1, DMA_OFF)) {
-			return (-EHW);
-		}
-        } while (!(stat & AT45DB_FLASH_READY));
-        return (0);
 }
 
 /**
- * at45db_page_erase
+ * trans
  */
-int at45db_page_erase(at45db fi, int page)
+static int trans(at45db fi, unsigned char *cmd, int cmd_sz, unsigned char *buf, int num,
+                 boolean_t dma)
 {
-        unsigned char cmd[] = {0x81, 0x00, 0x00, 0x00};
+	int ret;
+#if AT45DB_USE_TRACE == 1
+	struct at45db_trace_rec r;
 
-	if (!create_address(fi, cmd, page, 0)) {
-		return (-EADDR);
+	if (fi->tr_size) {
+		// Command can be overwritten by received data.
+		r.time = AT45DB_TRACE_TIME();
+		r.op = cmd[0];
+		r.addr = 0;
+		r.len = num;
+		if (cmd_sz >= 4) {
+			r.addr = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+		} else if (buf == cmd + 1 && num >= 3) {
+			// Address sent in data phase.
+			r.addr = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+			r.len = num - 3;
+		}
+		r.flags = (dma) ? AT45DB_TRACE_DMA : 0;
 	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-			   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+#endif
+	ret = spi_trans(fi->spi, &fi->csel, cmd, cmd_sz, buf, num, (dma) ? DMA_ON : DMA_OFF);
+#if AT45DB_USE_TRACE == 1
+	if (fi->tr_size) {
+		if (ret) {
+			r.flags |= AT45DB_TRACE_ERR;
+		}
+		fi->tr_buf[fi->tr_head] = r;
+		if (++fi->tr_head == fi->tr_size) {
+			fi->tr_head = 0;
+		}
+		if (fi->tr_num < fi->tr_size) {
+			fi->tr_num++;
+		} else {
+			fi->tr_lost++;
+		}
 	}
-        vTaskDelay(AT45DB_PAGE_ERASE_TIME);
-	return (wait_ready(fi));
+#endif
+	return (ret);
 }
 
 /**
- * at45db_check_page_erased
+ * blank_check
  */
-int at45db_check_page_erased(at45db fi, int page)
+static int blank_check(at45db fi, int page)
 {
         unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
 	unsigned char buf[8];
-        unsigned char stat;
-	int ret = 0;
+	int ret;
 
-        if (page < 0 || page >= fi->pg_count) {
-                return (-EADDR);
-        }
         // Fill buffer2 with 0xFF pattern.
-	if (!fi->buf2_ff) {
+	if (!fi->bufst[1].ff) {
+		buf_set(fi, 2, AT45DB_BUF_UNKNOWN, 0);
 		for (int i = 0; i < fi->pg_size / 8; i++) {
 			memset(buf, 0xFF, 8);
 			cmd[0] = 0x87;
 			adrbits(fi, 0, i * 8, cmd + 1);
-	                if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd),
-				           buf, 8, (fi->use_dma) ? DMA_ON : DMA_OFF)) {
+	                if (0 != trans(fi, cmd, sizeof(cmd), buf, 8, fi->use_dma)) {
 				return (-EHW);
 			}
-			fi->buf2_ff = TRUE;
 		}
+		fi->bufst[1].ff = TRUE;
 	}
         // Cmp buffer2 with page.
-        cmd[0] = 0x61;
-        adrbits(fi, page, 0, cmd + 1);
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-		           (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	ret = cmp_buf(fi, 2, page);
+#if AT45DB_USE_ERASE_MAP == 1
+	if (ret == 0 || ret == -EDATA) {
+		em_mark(fi, page, 1, (ret == 0) ? TRUE : FALSE);
 	}
-        do {
-                stat = 0xD7;
-                if (0 != spi_trans(fi->spi, &fi->csel, &stat, 1, &stat, 1, DMA_OFF)) {
-			return (-EHW);
-		}
-		if (stat & AT45DB_COMPARE_NOT_MATCH) {
-	                ret = -EDATA;
-	        }
-        } while (!(stat & AT45DB_FLASH_READY));
+#endif
 	return (ret);
 }
 
 /**
- * at45db_block_erase
- */
-int at45db_block_erase(at45db fi, int block)
-{
-        unsigned char cmd[] = {0x50, 0x00, 0x00, 0x00};
-
-        if (block < 0 || block >= fi->bl_count) {
-                return (-EADDR);
-        }
-	switch (fi->pg_size) {
-	case 264 :
-	        cmd[1] = block >> 4;
-		cmd[2] = block << 4;
-		break;
-	case 1056 :
-	        cmd[1] = block >> 2;
-		cmd[2] = block << 6;
-		break;
-	default :
-		crit_err_exit(BAD_PARAMETER);
-		break;
-	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
-	}
-        vTaskDelay(AT45DB_BLOCK_ERASE_TIME);
-	return (wait_ready(fi));
-}
-
-/**
- * at45db_chip_erase
+ * cmp_buf
  */
-int at45db_chip_erase(at45db fi)
+static int cmp_buf(at45db fi, int bfn, int page)
 {
-        unsigned char cmd[] = {0xC7, 0x94, 0x80, 0x9A};
-	int ret = 0;
+        unsigned char cmd[] = {(bfn == 1) ? 0x60 : 0x61, 0x00, 0x00, 0x00};
+        unsigned char stat;
+#if AT45DB_USE_RT == 1
+	TickType_t t0 = rt_base(fi);
+#endif
 
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
+        adrbits(fi, page, 0, cmd + 1);
+        if (0 != trans(fi, cmd, 1, cmd + 1, 3, fi->use_dma)) {
 		return (-EHW);
 	}
-#if AT45DB_USE_EXT_STAT == 1
-	unsigned int stat;
         do {
-		vTaskDelay(CHIP_ERASE_CHECK_RATE);
-		if (at45db_ext_stat(fi, &stat) != 0) {
+                stat = 0xD7;
+                if (0 != trans(fi, &stat, 1, &stat, 1, FALSE)) {
 			return (-EHW);
 		}
-		if (stat & AT45DB_PROG_ERR) {
-			ret = -EDATA;
-		}
-        } while (!(stat & AT45DB_FLASH_READY2));
-#else
-	unsigned char stat;
-        do {
-		vTaskDelay(CHIP_ERASE_CHECK_RATE);
-		stat = 0xD7;
-                if (0 != spi_trans(fi->spi, &fi->csel, &stat, 1, &stat, 1, DMA_OFF)) {
+#if AT45DB_USE_RT == 1
+		if (!(stat & AT45DB_FLASH_READY) && rt_expired(fi, t0)) {
 			return (-EHW);
 		}
-        } while (!(stat & AT45DB_FLASH_READY));
 #endif
-	return (ret);
-}
-
-/**
- * at45db_section_erase
- */
-int at45db_section_erase(at45db fi, int start, int end)
-{
-        int i, err;
-
-        if (start >= end) {
-                return (-EADDR);
-        }
-        if (start < 0 || start > fi->pg_count - 2 || end >= fi->pg_count) {
-                return (-EADDR);
-        }
-        for (i = start; i <= end; i++) {
-                if (0 != (err = at45db_page_erase(fi, i))) {
-			return (err);
-		}
-                if (0 != (err = at45db_check_page_erased(fi, i))) {
-                        return (err);
-                }
-        }
-        return (0);
+        } while (!(stat & AT45DB_FLASH_READY));
+	return ((stat & AT45DB_COMPARE_NOT_MATCH) ? -EDATA : 0);
 }
 
+#if AT45DB_USE_RT == 1
 /**
- * at45db_read_cont
+ * rt_lock
  */
-int at45db_read_cont(at45db fi, enum at45db_read_cont_type type, unsigned char *buf, int page, int offs, int num)
+static boolean_t rt_lock(at45db fi)
 {
-        unsigned char cmd[] = {type, 0x00, 0x00, 0x00, 0xFF, 0xFF};
-	int cmd_sz = 0;
+	TickType_t t0 = xTaskGetTickCount();
 
-	if (!create_address(fi, cmd, page, offs)) {
-		return (-EADDR);
-	}
-	switch (type) {
-	case AT45DB_READ_CONT_HF0 :
-		cmd_sz = 5;
-		break;
-	case AT45DB_READ_CONT_HF1 :
-		cmd_sz = 6;
-		break;
-	case AT45DB_READ_CONT_LF :
-		/* FALLTHRU */
-	case AT45DB_READ_CONT_LP :
-		cmd_sz = 4;
-		break;
-	default :
-		crit_err_exit(BAD_PARAMETER);
-		break;
+	if (!lock_tmo(fi, (fi->rt_tmo) ? fi->rt_tmo : portMAX_DELAY)) {
+		return (FALSE);
 	}
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, cmd_sz, buf, num,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	if (fi->rt_nest++ == 0) {
+		// Deadline of outermost instrumented function includes lock wait.
+		fi->rt_start = t0;
 	}
-	return (0);
+	return (TRUE);
 }
 
 /**
- * at45db_read_mod_write
+ * rt_exit
  */
-int at45db_read_mod_write(at45db fi, unsigned char *buf, int bfn, int page, int offs, int num)
+static void rt_exit(at45db fi, enum at45db_api api, uint32_t t0)
 {
-        unsigned char cmd[] = {0x00, 0x00, 0x00, 0x00};
+	uint32_t t = AT45DB_RT_TIME() - t0;
 
-        if (bfn == 1) {
-                cmd[0] = 0x58;
-        } else if (bfn == 2) {
-                cmd[0] = 0x59;
-        } else {
-                crit_err_exit(BAD_PARAMETER);
-        }
-	if (!create_address(fi, cmd, page, offs)) {
-		return (-EADDR);
-	}
-        if (bfn == 2) {
-                fi->buf2_ff = FALSE;
-        }
-        if (0 != spi_trans(fi->spi, &fi->csel, cmd, sizeof(cmd), buf, num,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	if (t > fi->rt_wcet[api]) {
+		fi->rt_wcet[api] = t;
 	}
-        vTaskDelay(AT45DB_PAGE_ERASE_PROG_TIME);
-	return (wait_ready(fi));
+	fi->rt_nest--;
 }
 
 /**
- * at45db_pwr_down
+ * rt_base
  */
-int at45db_pwr_down(at45db fi, enum at45db_pwr_down_type type)
+static TickType_t rt_base(at45db fi)
 {
-	unsigned char cmd = type;
-
-	switch (cmd) {
-	case AT45DB_ULTRA_DEEP_PWR_DOWN :
-		fi->buf2_ff = FALSE;
-		/* FALLTHRU */
-	case AT45DB_DEEP_PWR_DOWN :
-		break;
-	default :
-		crit_err_exit(BAD_PARAMETER);
-		break;
-	}
-        if (0 != spi_trans(fi->spi, &fi->csel, &cmd, 1, &cmd, 0, DMA_OFF)) {
-		return (-EHW);
-	}
-	return (0);
+	// Status wait outside of instrumented function has own timeout.
+	return ((fi->rt_nest) ? fi->rt_start : xTaskGetTickCount());
 }
 
 /**
- * at45db_wake
+ * rt_left
  */
-int at45db_wake(at45db fi)
+static TickType_t rt_left(at45db fi, TickType_t t)
 {
-	unsigned char cmd = 0xAB;
+	TickType_t e;
 
-        if (0 != spi_trans(fi->spi, &fi->csel, &cmd, 1, &cmd, 0, DMA_OFF)) {
-		return (-EHW);
+	if (fi->rt_tmo == 0 || fi->rt_nest == 0) {
+		return (t);
 	}
-	return (0);
+	if ((e = xTaskGetTickCount() - fi->rt_start) >= fi->rt_tmo) {
+		return (0);
+	}
+	return ((t < fi->rt_tmo - e) ? t : fi->rt_tmo - e);
 }
 
 /**
- * at45db_set_page_size
+ * rt_expired
  */
-int at45db_set_page_size(at45db fi, enum at45db_page_size sz)
+static boolean_t rt_expired(at45db fi, TickType_t t0)
 {
-	unsigned char cmd[] = {0x3D, 0x2A, 0x80, 0x00};
-
-	if (sz != AT45DB_SET_PAGE_SIZE_PO2 && sz != AT45DB_SET_PAGE_SIZE_STD) {
-		crit_err_exit(BAD_PARAMETER);
-	}
-	cmd[3] = sz;
-	if (0 != spi_trans(fi->spi, &fi->csel, cmd, 1, cmd + 1, 3,
-	                   (fi->use_dma) ? DMA_ON : DMA_OFF)) {
-		return (-EHW);
+	if (fi->rt_tmo && xTaskGetTickCount() - t0 >= fi->rt_tmo) {
+		// Device stays busy, service task waits for at45db_busy().
+		fi->rt_busy = TRUE;
+		return (TRUE);
 	}
-	return (0);
+	return (FALSE);
 }
+#endif
 
 /**
  * wait_ready
@@ -518,6 +2429,9 @@ static int wait_ready(at45db fi)
 {
 	boolean_t first = TRUE;
 	int ret = 0;
+#if AT45DB_USE_RT == 1
+	TickType_t t0 = rt_base(fi);
+#endif
 
 #if AT45DB_USE_EXT_STAT == 1
 	unsigned int stat;
@@ -533,6 +2447,11 @@ static int wait_ready(at45db fi)
 		if (stat & AT45DB_PROG_ERR) {
 			ret = -EDATA;
 		}
+#if AT45DB_USE_RT == 1
+		if (!(stat & AT45DB_FLASH_READY2) && rt_expired(fi, t0)) {
+			return (-EHW);
+		}
+#endif
         } while (!(stat & AT45DB_FLASH_READY2));
 #else
 	unsigned char stat;
@@ -543,10 +2462,18 @@ static int wait_ready(at45db fi)
                         first = FALSE;
                 }
                 stat = 0xD7;
-                if (0 != spi_trans(fi->spi, &fi->csel, &stat, 1, &stat, 1, DMA_OFF)) {
+                if (0 != trans(fi, &stat, 1, &stat, 1, FALSE)) {
+			return (-EHW);
+		}
+#if AT45DB_USE_RT == 1
+		if (!(stat & AT45DB_FLASH_READY) && rt_expired(fi, t0)) {
 			return (-EHW);
 		}
+#endif
         } while (!(stat & AT45DB_FLASH_READY));
+#endif
+#if AT45DB_USE_RT == 1
+	fi->rt_busy = FALSE;
 #endif
         return (ret);
 }
@@ -695,7 +2622,10 @@ static int t_device(at45db fi, boolean_t verb)
 			}
 			goto err_exit;
 		}
-		if (0 != (err = at45db_check_page_erased(fi, j))) {
+		lock(fi);
+		err = blank_check(fi, j);
+		unlock(fi);
+		if (err) {
 			if (verb) {
 				msg(INF, "at45db.c: page %d verify erase error\n", j);
 			}
@@ -751,6 +2681,14 @@ static int t_readpage(at45db fi, unsigned char *buf, int page, boolean_t verb)
 	for (int i = 0; i < fi->pg_size; i++) {
 		*(buf + i) = 0;
 	}
+	// Drop page mirror, page is read from main memory.
+	lock(fi);
+	for (int i = 1; i <= 2; i++) {
+		if (fi->bufst[i - 1].state == AT45DB_BUF_CLEAN && fi->bufst[i - 1].page == page) {
+			buf_set(fi, i, AT45DB_BUF_UNKNOWN, 0);
+		}
+	}
+	unlock(fi);
 	if (0 != at45db_read_mem(fi, buf, page, 0, fi->pg_size)) {
 		if (verb) {
 			msg(INF, "at45db.c: page %d read error (", page);
@@ -23,6 +23,153 @@
   #define AT45DB_USE_EXT_STAT 0
 #endif
 
+#ifndef AT45DB_USE_ERASE_AHEAD
+  #define AT45DB_USE_ERASE_AHEAD 0
+#endif
+
+#ifndef AT45DB_USE_PROTECT
+  #define AT45DB_USE_PROTECT 0
+#endif
+
+#ifndef AT45DB_USE_WEAR
+  #define AT45DB_USE_WEAR 0
+#endif
+
+#ifndef AT45DB_USE_PWR_MNG
+  #define AT45DB_USE_PWR_MNG 0
+#endif
+
+#ifndef AT45DB_USE_TIMING
+  #define AT45DB_USE_TIMING 0
+#endif
+
+#ifndef AT45DB_USE_REFRESH
+  #define AT45DB_USE_REFRESH 0
+#endif
+
+#ifndef AT45DB_USE_READ_AHEAD
+  #define AT45DB_USE_READ_AHEAD 0
+#endif
+
+#ifndef AT45DB_USE_TRACE
+  #define AT45DB_USE_TRACE 0
+#endif
+
+#ifndef AT45DB_USE_VERIFY
+  #define AT45DB_USE_VERIFY 0
+#endif
+
+#ifndef AT45DB_USE_RT
+  #define AT45DB_USE_RT 0
+#endif
+
+#ifndef AT45DB_USE_ERASE_MAP
+  #define AT45DB_USE_ERASE_MAP 0
+#endif
+
+#if AT45DB_USE_ERASE_AHEAD == 1 && AT45DB_USE_ERASE_MAP == 0
+  #undef AT45DB_USE_ERASE_MAP
+  #define AT45DB_USE_ERASE_MAP 1
+#endif
+
+#if AT45DB_USE_ERASE_AHEAD == 1 || AT45DB_USE_PWR_MNG == 1 || AT45DB_USE_REFRESH == 1
+  #define AT45DB_USE_SVC 1
+#else
+  #define AT45DB_USE_SVC 0
+#endif
+
+#if AT45DB_USE_PWR_MNG == 1
+// Power manager statistics.
+struct at45db_pwr_stat {
+        unsigned int active_ms; // Time in standby/active mode.
+        unsigned int dpd_ms;    // Time in deep power-down.
+        unsigned int udpd_ms;   // Time in ultra-deep power-down.
+        unsigned int wakes;     // Count of wake-ups.
+        unsigned int wake_ms;   // Total time spent by wake-up delays.
+        unsigned int energy_uj; // Estimated energy consumption.
+};
+#endif
+
+#define AT45DB_SECT_COUNT 32
+
+#if AT45DB_USE_PROTECT == 1
+#define AT45DB_SECREG_SIZE      128
+#define AT45DB_SECREG_USER_SIZE 64
+#endif
+
+#if AT45DB_USE_WEAR == 1
+// Block erase count.
+struct at45db_wear_hot {
+        int block;
+        unsigned int cnt;
+};
+#endif
+
+#if AT45DB_USE_TRACE == 1
+// SPI transaction trace record.
+struct at45db_trace_rec {
+        uint32_t time;  // Transaction start (AT45DB_TRACE_TIME() units).
+        uint32_t addr;  // Address bytes of command.
+        uint16_t len;   // Data phase length.
+        uint8_t op;     // Opcode.
+        uint8_t flags;  // AT45DB_TRACE_DMA, AT45DB_TRACE_ERR.
+};
+
+#define AT45DB_TRACE_DMA (0x1 << 0)
+#define AT45DB_TRACE_ERR (0x1 << 1)
+#endif
+
+// Self-timed operations.
+enum at45db_op {
+	AT45DB_OP_PAGE_ERASE_PROG,
+	AT45DB_OP_PAGE_PROG,
+	AT45DB_OP_PAGE_ERASE,
+	AT45DB_OP_BLOCK_ERASE,
+	AT45DB_OP_RMW,
+	AT45DB_OP_COUNT
+};
+
+#if AT45DB_USE_TIMING == 1
+enum at45db_part {
+	AT45DB_PART_UNKNOWN,
+	AT45DB_PART_642,
+	AT45DB_PART_642D,
+	AT45DB_PART_641E
+};
+#endif
+
+#if AT45DB_USE_RT == 1
+// Instrumented functions.
+enum at45db_api {
+	AT45DB_API_READ_MEM,
+	AT45DB_API_WRITE_MEM,
+	AT45DB_API_READ_BUF,
+	AT45DB_API_WRITE_BUF,
+	AT45DB_API_STORE_BUF,
+	AT45DB_API_LOAD_BUF,
+	AT45DB_API_PAGE_ERASE,
+	AT45DB_API_CHECK_ERASED,
+	AT45DB_API_BLOCK_ERASE,
+	AT45DB_API_CHIP_ERASE,
+	AT45DB_API_READ_CONT,
+	AT45DB_API_RMW,
+	AT45DB_API_COUNT
+};
+#endif
+
+// Flash buffer state.
+enum at45db_buf_state {
+	AT45DB_BUF_UNKNOWN, // Buffer content not related to main memory.
+	AT45DB_BUF_CLEAN,   // Buffer mirrors main memory page.
+	AT45DB_BUF_DIRTY    // Buffer modified (page -1 - staged data).
+};
+
+struct at45db_buf_st {
+        enum at45db_buf_state state;
+        int page;
+        boolean_t ff; // Buffer filled with 0xFF pattern.
+};
+
 // AT45DB flash descriptor.
 typedef struct at45db_dsc *at45db;
 
@@ -34,7 +181,74 @@ struct at45db_dsc {
         struct spi_csel_dcs csel;  // <SetIt>
         char *id;          // <SetIt>
 	boolean_t use_dma; // <SetIt>
-        boolean_t buf2_ff; // <SetIt> FALSE
+        struct at45db_buf_st bufst[2]; // <SetIt> {{0}}
+        SemaphoreHandle_t mtx; // <SetIt> NULL (recursive mutex)
+#if AT45DB_USE_SVC == 1
+        TaskHandle_t svc_tsk;  // <SetIt> NULL
+        TickType_t last_use;   // <SetIt> 0
+#endif
+#if AT45DB_USE_ERASE_AHEAD == 1
+        unsigned char *ea_dirty;  // <SetIt> NULL
+        int ea_cursor;            // <SetIt> 0
+#endif
+#if AT45DB_USE_ERASE_MAP == 1
+        unsigned char *em_known;  // <SetIt> NULL
+        unsigned char *em_blank;  // <SetIt> NULL
+#endif
+#if AT45DB_USE_PROTECT == 1
+        unsigned char prot_reg[AT45DB_SECT_COUNT]; // <SetIt> {0}
+        unsigned char lock_reg[AT45DB_SECT_COUNT]; // <SetIt> {0}
+        boolean_t prot_en;    // <SetIt> FALSE
+        boolean_t prot_valid; // <SetIt> FALSE
+#endif
+#if AT45DB_USE_WEAR == 1
+        uint32_t *wr_img; // <SetIt> NULL
+        int wr_page;      // <SetIt> 0
+        int wr_slot;      // <SetIt> 0
+        int wr_chg;       // <SetIt> 0
+#endif
+#if AT45DB_USE_REFRESH == 1
+        boolean_t rf_en;      // <SetIt> FALSE
+        int rf_page;          // <SetIt> 0
+        int rf_budget;        // <SetIt> 0
+        TickType_t rf_time;   // <SetIt> 0
+        unsigned int rf_base; // <SetIt> 0
+#endif
+#if AT45DB_USE_TIMING == 1
+        unsigned int tm_est[AT45DB_OP_COUNT]; // <SetIt> {0}
+#endif
+#if AT45DB_USE_PWR_MNG == 1
+        TickType_t pm_tmo;        // <SetIt> 0 (idle timeout, 0 - disabled)
+        unsigned char pm_type;    // <SetIt> AT45DB_DEEP_PWR_DOWN
+        unsigned char pm_state;   // <SetIt> 0
+        TickType_t pm_since;      // <SetIt> 0
+        struct at45db_pwr_stat pm_stat; // <SetIt> {0}
+#endif
+#if AT45DB_USE_READ_AHEAD == 1
+        unsigned char *ra_cache; // <SetIt> NULL
+        int ra_pages; // <SetIt> 0
+        int ra_first; // <SetIt> 0
+        int ra_num;   // <SetIt> 0
+        int ra_last;  // <SetIt> 0
+        int ra_run;   // <SetIt> 0
+#endif
+#if AT45DB_USE_TRACE == 1
+        struct at45db_trace_rec *tr_buf; // <SetIt> NULL
+        int tr_size;           // <SetIt> 0
+        int tr_head;           // <SetIt> 0
+        int tr_num;            // <SetIt> 0
+        unsigned int tr_lost;  // <SetIt> 0
+#endif
+#if AT45DB_USE_VERIFY == 1
+        boolean_t vfy;         // <SetIt> FALSE (verify programmed pages)
+#endif
+#if AT45DB_USE_RT == 1
+        TickType_t rt_tmo;     // <SetIt> 0 (call timeout, 0 - unlimited)
+        TickType_t rt_start;   // <SetIt> 0
+        int rt_nest;           // <SetIt> 0
+        boolean_t rt_busy;     // <SetIt> FALSE
+        uint32_t rt_wcet[AT45DB_API_COUNT]; // <SetIt> {0}
+#endif
 };
 
 // Status Register Format - byte 1.
@@ -82,7 +296,8 @@ int at45db_ext_stat(at45db fi, unsigned int *stat);
  *
  * Main Memory Page Read allows the reading of data directly from a single
  * page in the main memory, bypassing both of the data buffers and leaving
- * the contents of the buffers unchanged.
+ * the contents of the buffers unchanged. Page mirrored in flash buffer
+ * (AT45DB_BUF_CLEAN) is read from the buffer instead.
  *
  * @fi: Flash instance.
  * @buf: Buffer for data.
@@ -128,6 +343,9 @@ int at45db_read_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num);
 /**
  * at45db_write_buf - write to flash buffer.
  *
+ * Buffer is marked AT45DB_BUF_DIRTY, buffer without page mirror with page
+ * -1 (staged data). Service task does not use such buffer.
+ *
  * @fi: Flash instance.
  * @buf: Data buffer.
  * @bfn: Select flash buffer (1 or 2).
@@ -150,6 +368,77 @@ int at45db_write_buf(at45db fi, unsigned char *buf, int bfn, int offs, int num);
  */
 int at45db_store_buf(at45db fi, int bfn, int page, boolean_t erase);
 
+/**
+ * at45db_store_buf_start - start store of flash buffer to main memory page.
+ *
+ * Function returns without waiting for end of programming. Meanwhile only
+ * other buffer can be written by at45db_write_buf(). Caller must hold
+ * instance lock and call at45db_wait_ready() before next operation.
+ *
+ * @fi: Flash instance.
+ * @bfn: Select flash buffer (1 or 2).
+ * @page: Page number.
+ * @erase: TRUE - enable page erase before write.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_store_buf_start(at45db fi, int bfn, int page, boolean_t erase);
+
+/**
+ * at45db_wait_ready - wait for end of self-timed operation.
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_wait_ready(at45db fi);
+
+#if AT45DB_USE_RT == 1
+/**
+ * at45db_chip_erase_start - start chip erase.
+ *
+ * Function returns without waiting for end of erase. Caller must hold
+ * instance lock and poll at45db_busy() before next operation.
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error.
+ */
+int at45db_chip_erase_start(at45db fi);
+
+/**
+ * at45db_busy - poll self-timed operation by one status read.
+ *
+ * Splits operations started by at45db_chip_erase_start() or
+ * at45db_store_buf_start() to bounded slices.
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: 0 - ready; 1 - busy; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_busy(at45db fi);
+
+/**
+ * at45db_wcet - get worst-case execution time of function.
+ *
+ * Instrumented functions (enum at45db_api) end with -EHW when not finished
+ * in fi->rt_tmo ticks from call (lock wait, operation time and status
+ * polling). Device stayed busy if fi->rt_busy is set, service task is
+ * stopped then and caller must poll at45db_busy() before next operation.
+ * Other functions (at45db_stat(), at45db_section_erase(), wear and
+ * protection functions, ...) wait for lock without limit, only their status
+ * waits end after fi->rt_tmo ticks. Execution times are measured in
+ * AT45DB_RT_TIME() units.
+ *
+ * @fi: Flash instance.
+ * @api: Function.
+ * @reset: TRUE - reset measured value.
+ *
+ * Returns: Maximal observed execution time.
+ */
+uint32_t at45db_wcet(at45db fi, enum at45db_api api, boolean_t reset);
+#endif
+
 /**
  * at45db_load_buf - load page from main memory to flash buffer.
  *
@@ -161,6 +450,38 @@ int at45db_store_buf(at45db fi, int bfn, int page, boolean_t erase);
  */
 int at45db_load_buf(at45db fi, int bfn, int page);
 
+/**
+ * at45db_compare_buf - main memory page to buffer compare.
+ *
+ * Compare is performed by device without data transfer over SPI. With
+ * AT45DB_USE_VERIFY and fi->vfy set, pages programmed by at45db_write_mem(),
+ * at45db_store_buf() and at45db_read_mod_write() are verified by compare
+ * with buffer content.
+ *
+ * @fi: Flash instance.
+ * @bfn: Select flash buffer (1 or 2).
+ * @page: Page number.
+ *
+ * Returns: 0 - page equals buffer; -EADDR - bad address; -EHW - hardware error;
+ *          -EDATA - page differs.
+ */
+int at45db_compare_buf(at45db fi, int bfn, int page);
+
+/**
+ * at45db_buf_state - get flash buffer state.
+ *
+ * Driver tracks relation of flash buffers to main memory pages. Page
+ * mirrored in buffer is read by at45db_read_mem() from buffer and
+ * at45db_load_buf() of same page is skipped.
+ *
+ * @fi: Flash instance.
+ * @bfn: Select flash buffer (1 or 2).
+ * @page: Pointer to storage for related page number or NULL.
+ *
+ * Returns: Buffer state (enum at45db_buf_state).
+ */
+enum at45db_buf_state at45db_buf_state(at45db fi, int bfn, int *page);
+
 /**
  * at45db_page_erase - erase page.
  *
@@ -282,6 +603,32 @@ int at45db_pwr_down(at45db fi, enum at45db_pwr_down_type type);
  */
 int at45db_wake(at45db fi);
 
+#if AT45DB_USE_PWR_MNG == 1
+/**
+ * at45db_pwr_mng - configure automatic power down.
+ *
+ * Service task powers device down after idle timeout. Next operation wakes
+ * device up and waits tRDPD (AT45DB_RDPD_TIME) or tXUDPD (AT45DB_XUDPD_TIME).
+ * Requires running service task (at45db_svc_start()).
+ *
+ * @fi: Flash instance.
+ * @type: Device power down type (deep or ultradeep).
+ * @tmo: Idle timeout in ticks (0 - disable automatic power down).
+ */
+void at45db_pwr_mng(at45db fi, enum at45db_pwr_down_type type, TickType_t tmo);
+
+/**
+ * at45db_pwr_stat - get power manager statistics.
+ *
+ * Energy is estimated from time spent in power modes and currents
+ * AT45DB_STBY_CURR_NA, AT45DB_DPD_CURR_NA, AT45DB_UDPD_CURR_NA at AT45DB_VCC_MV.
+ *
+ * @fi: Flash instance.
+ * @st: Pointer to statistics storage.
+ */
+void at45db_pwr_stat(at45db fi, struct at45db_pwr_stat *st);
+#endif
+
 enum at45db_page_size {
 	AT45DB_SET_PAGE_SIZE_PO2 = 0xA6,
 	AT45DB_SET_PAGE_SIZE_STD = 0xA7
@@ -297,6 +644,333 @@ enum at45db_page_size {
  */
 int at45db_set_page_size(at45db fi, enum at45db_page_size sz);
 
+#if AT45DB_USE_WEAR == 1
+/**
+ * at45db_wear_init - initialize wear counters.
+ *
+ * Counters of block erases and sector page programs (since last sector
+ * refresh) are kept in RAM and persisted in reserved area of
+ * at45db_wear_area_pages() pages (two alternating slots). Repeated call
+ * reloads counters from reserved area, unsynced changes are lost.
+ *
+ * @fi: Flash instance.
+ * @page: First page of reserved area.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_wear_init(at45db fi, int page);
+
+/**
+ * at45db_wear_sync - store wear counters to reserved area.
+ *
+ * Counters are written through flash buffer 1, its content is destroyed.
+ * Service task (if used) stores counters after AT45DB_WEAR_SYNC_CNT changes
+ * through flash buffer without modified or staged data (AT45DB_BUF_DIRTY),
+ * sync is postponed while both buffers hold such data.
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_wear_sync(at45db fi);
+
+/**
+ * at45db_wear_area_pages - get size of reserved area.
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: Count of pages.
+ */
+int at45db_wear_area_pages(at45db fi);
+
+/**
+ * at45db_wear_hot - get most erased blocks.
+ *
+ * @fi: Flash instance.
+ * @hot: Array for result, sorted by erase count (descending).
+ * @num: Size of array.
+ *
+ * Returns: Count of items stored in array.
+ */
+int at45db_wear_hot(at45db fi, struct at45db_wear_hot *hot, int num);
+
+/**
+ * at45db_wear_sect_prog - get count of page programs in sector.
+ *
+ * Every page of sector must be rewritten before count reaches datasheet limit
+ * of cumulative page erase and program operations (see at45db_sect_refresh()).
+ *
+ * @fi: Flash instance.
+ * @sect: Sector number (0 - AT45DB_SECT_COUNT - 1).
+ *
+ * Returns: Count of page programs since last sector refresh.
+ */
+unsigned int at45db_wear_sect_prog(at45db fi, int sect);
+
+/**
+ * at45db_sect_refresh - rewrite all pages of sector.
+ *
+ * Pages are rewritten by Auto Page Rewrite through flash buffer 1.
+ *
+ * @fi: Flash instance.
+ * @sect: Sector number (0 - AT45DB_SECT_COUNT - 1).
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error;
+ *          -EDATA - write error.
+ */
+int at45db_sect_refresh(at45db fi, int sect);
+#endif
+
+#if AT45DB_USE_REFRESH == 1
+/**
+ * at45db_refresh_enable - enable background page refresh.
+ *
+ * Service task rewrites pages (Auto Page Rewrite) in rolling sweep over
+ * whole device in idle time, at most AT45DB_REFRESH_PAGES pages per
+ * AT45DB_REFRESH_PERIOD. With wear counters (AT45DB_USE_WEAR) the sweep
+ * jumps at sector start to sector which reached AT45DB_REFRESH_LIMIT page
+ * programs, sector is always rewritten whole.
+ * Pages discarded by at45db_discard() are skipped. Flash buffer holding
+ * modified or staged data (AT45DB_BUF_DIRTY) is not used by sweep.
+ *
+ * @fi: Flash instance.
+ * @en: TRUE - enable; FALSE - disable.
+ */
+void at45db_refresh_enable(at45db fi, boolean_t en);
+#endif
+
+#if AT45DB_USE_PROTECT == 1
+/**
+ * at45db_prot_load - load sector protection and lockdown state to cache.
+ *
+ * Cached state is loaded automatically by first write or erase operation.
+ * Program or erase of page in protected or locked sector is rejected
+ * without device access (-EADDR).
+ *
+ * @fi: Flash instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error.
+ */
+int at45db_prot_load(at45db fi);
+
+/**
+ * at45db_prot_enable - enable or disable sector protection.
+ *
+ * @fi: Flash instance.
+ * @en: TRUE - enable; FALSE - disable.
+ *
+ * Returns: 0 - success; -EHW - hardware error.
+ */
+int at45db_prot_enable(at45db fi, boolean_t en);
+
+/**
+ * at45db_prot_set - erase and program sector protection register.
+ *
+ * Register byte 0 selects sector 0a (0xC0) and 0b (0x30), bytes 1 - 31
+ * sectors 1 - 31 (0xFF - protected, 0x00 - unprotected). Flash buffer 1
+ * content is destroyed.
+ *
+ * @fi: Flash instance.
+ * @reg: New register content (AT45DB_SECT_COUNT bytes).
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - program error.
+ */
+int at45db_prot_set(at45db fi, unsigned char *reg);
+
+/**
+ * at45db_prot_get - get sector protection state.
+ *
+ * @fi: Flash instance.
+ * @reg: Buffer for register content (AT45DB_SECT_COUNT bytes).
+ * @en: Pointer to storage for protection enabled state or NULL.
+ *
+ * Returns: 0 - success; -EHW - hardware error.
+ */
+int at45db_prot_get(at45db fi, unsigned char *reg, boolean_t *en);
+
+/**
+ * at45db_sect_lockdown - permanently lock sector.
+ *
+ * Operation is irreversible. Flash buffer 1 content is destroyed.
+ *
+ * @fi: Flash instance.
+ * @page: Any page of locked sector.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error;
+ *          -EDATA - program error.
+ */
+int at45db_sect_lockdown(at45db fi, int page);
+
+/**
+ * at45db_secreg_read - read security register.
+ *
+ * Bytes 0 - 63 are user programmable, bytes 64 - 127 are factory programmed.
+ *
+ * @fi: Flash instance.
+ * @buf: Buffer for data.
+ * @offs: Data offset in register.
+ * @num: Count of bytes to read.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_secreg_read(at45db fi, unsigned char *buf, int offs, int num);
+
+/**
+ * at45db_secreg_write - program user part of security register.
+ *
+ * Register can be programmed only once. Flash buffer 1 content is destroyed.
+ *
+ * @fi: Flash instance.
+ * @buf: Data buffer (AT45DB_SECREG_USER_SIZE bytes).
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - program error.
+ */
+int at45db_secreg_write(at45db fi, unsigned char *buf);
+#endif
+
+#if AT45DB_USE_TIMING == 1
+/**
+ * at45db_detect - detect device and select timing profile.
+ *
+ * Driver sleeps estimated operation time before status polling and refines
+ * estimates by measured completion times. Without detection the estimates
+ * start from AT45DB_*_TIME values.
+ *
+ * @fi: Flash instance.
+ * @part: Pointer to storage for detected part or NULL.
+ *
+ * Returns: 0 - success; -EHW - hardware error.
+ */
+int at45db_detect(at45db fi, enum at45db_part *part);
+
+/**
+ * at45db_op_time - get estimated operation time.
+ *
+ * @fi: Flash instance.
+ * @op: Operation.
+ *
+ * Returns: Estimated time in ticks.
+ */
+TickType_t at45db_op_time(at45db fi, enum at45db_op op);
+
+/**
+ * at45db_set_op_time - set estimated operation time.
+ *
+ * @fi: Flash instance.
+ * @op: Operation.
+ * @t: Time in ticks.
+ */
+void at45db_set_op_time(at45db fi, enum at45db_op op, TickType_t t);
+#endif
+
+/**
+ * at45db_lock - lock flash instance.
+ *
+ * Reserves flash instance (and its buffers) for sequence of operations
+ * of calling task. Lock is recursive and effective only if fi->mtx is set.
+ *
+ * @fi: Flash instance.
+ */
+void at45db_lock(at45db fi);
+
+/**
+ * at45db_unlock - unlock flash instance.
+ *
+ * @fi: Flash instance.
+ */
+void at45db_unlock(at45db fi);
+
+#if AT45DB_USE_SVC == 1
+/**
+ * at45db_svc_start - start background service task.
+ *
+ * Service task runs maintenance of flash instance (erase-ahead) when no other
+ * task used the instance for AT45DB_SVC_IDLE_TIME. Function creates instance
+ * mutex if fi->mtx is NULL.
+ *
+ * @fi: Flash instance.
+ * @prio: Service task priority (lower than priority of flash users).
+ */
+void at45db_svc_start(at45db fi, UBaseType_t prio);
+#endif
+
+#if AT45DB_USE_ERASE_AHEAD == 1
+/**
+ * at45db_discard - discard pages content.
+ *
+ * Pages are marked as free and service task erases them in idle time.
+ * Service task must be started by at45db_svc_start() before.
+ * Subsequent at45db_write_mem() or at45db_store_buf() to erased page
+ * is performed without built-in erase.
+ *
+ * @fi: Flash instance.
+ * @start: Start page.
+ * @end: End page.
+ *
+ * Returns: 0 - success; -EADDR - bad address.
+ */
+int at45db_discard(at45db fi, int start, int end);
+#endif
+
+#if AT45DB_USE_ERASE_MAP == 1
+/**
+ * at45db_erase_map_init - allocate and clear erase state map.
+ *
+ * Map holds known and erased bit for every page. Successful erase marks
+ * page erased, program, store and failed erase make page state unknown and
+ * at45db_check_page_erased() records checked state. Pages with known state
+ * are checked without device access, at45db_section_erase() always checks
+ * device. All pages start unknown, calling function again forgets state of
+ * all pages.
+ *
+ * @fi: Flash instance.
+ */
+void at45db_erase_map_init(at45db fi);
+#endif
+
+#if AT45DB_USE_READ_AHEAD == 1
+/**
+ * at45db_read_ahead - set read-ahead cache size.
+ *
+ * When at45db_read_mem() detects AT45DB_READ_AHEAD_TRIG reads of consecutive
+ * pages, next pages are read to RAM cache by one continuous array read and
+ * following page reads are served from the cache. Cache is invalidated by
+ * any page program or erase.
+ *
+ * @fi: Flash instance.
+ * @pages: Count of cached pages (0 - read-ahead disabled).
+ */
+void at45db_read_ahead(at45db fi, int pages);
+#endif
+
+#if AT45DB_USE_TRACE == 1
+/**
+ * at45db_trace_start - start or stop SPI transaction tracing.
+ *
+ * Each SPI transaction of flash instance is recorded to ring buffer, oldest
+ * records are overwritten when buffer is full.
+ *
+ * @fi: Flash instance.
+ * @size: Count of ring buffer records (0 - tracing stopped).
+ */
+void at45db_trace_start(at45db fi, int size);
+
+/**
+ * at45db_trace_read - read and remove oldest trace records.
+ *
+ * Records written in binary form (little endian) can be replayed by
+ * tools/at45db_trace_replay.c.
+ *
+ * @fi: Flash instance.
+ * @rec: Buffer for records.
+ * @num: Size of buffer in records.
+ * @lost: Pointer to storage for count of overwritten records or NULL.
+ *
+ * Returns: Count of records read.
+ */
+int at45db_trace_read(at45db fi, struct at45db_trace_rec *rec, int num, unsigned int *lost);
+#endif
+
 #if AT45DB_TEST_CODE == 1
 /**
  * at45db_rw_test - test flash RW operations by data integrity.
@@ -0,0 +1,272 @@
+/*
+ * at45db_atom.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "crc.h"
+#include "at45db.h"
+#include "at45db_atom.h"
+#include <string.h>
+#include <stdint.h>
+
+#define ROOT_MAGIC 0x41544F4D
+
+// Root record header.
+struct root_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t crc;
+	uint16_t count;
+};
+
+static int read_root(at45db_atom a, int slot, uint32_t *seq);
+static uint16_t root_crc(uint32_t seq, uint16_t *map, int count);
+static int alloc_page(at45db_atom a);
+
+/**
+ * at45db_atom_mount
+ */
+int at45db_atom_mount(at45db_atom a)
+{
+	at45db fi = a->fi;
+	uint32_t seq[2];
+	int valid[2], err = 0;
+
+	if (sizeof(struct root_hdr) + a->lp_count * sizeof(uint16_t) > (unsigned int) fi->pg_size ||
+	    a->pool_count <= a->lp_count || a->pool_page < 0 ||
+	    a->pool_page + a->pool_count > fi->pg_count) {
+		return (-EADDR);
+	}
+	if (a->map == NULL) {
+		if (NULL == (a->map = pvPortMalloc(a->lp_count * sizeof(uint16_t)))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		if (NULL == (a->tx_map = pvPortMalloc(a->lp_count * sizeof(uint16_t)))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	at45db_lock(fi);
+	for (int i = 0; i < 2; i++) {
+		if ((valid[i] = read_root(a, i, &seq[i])) < 0) {
+			err = valid[i];
+			goto exit;
+		}
+	}
+	if (valid[0] || valid[1]) {
+		a->root_slot = (valid[0] && (!valid[1] || seq[0] > seq[1])) ? 0 : 1;
+		a->seq = seq[a->root_slot];
+		// Load map of selected slot.
+		if ((err = read_root(a, a->root_slot, &seq[0])) > 0) {
+			err = 0;
+		}
+		goto exit;
+	}
+	// Format region.
+	for (int i = 0; i < a->lp_count; i++) {
+		a->map[i] = i;
+	}
+	a->seq = 0;
+	a->root_slot = 1;
+	a->tx = TRUE;
+	memcpy(a->tx_map, a->map, a->lp_count * sizeof(uint16_t));
+	err = at45db_atom_commit(a);
+exit:
+	a->tx = FALSE;
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_atom_begin
+ */
+void at45db_atom_begin(at45db_atom a)
+{
+	memcpy(a->tx_map, a->map, a->lp_count * sizeof(uint16_t));
+	a->tx = TRUE;
+}
+
+/**
+ * at45db_atom_write
+ */
+int at45db_atom_write(at45db_atom a, unsigned char *buf, int lpage, int offs, int num)
+{
+	at45db fi = a->fi;
+	int pg, err;
+
+	if (!a->tx || lpage < 0 || lpage >= a->lp_count || offs < 0 || num < 0 ||
+	    offs + num > fi->pg_size) {
+		return (-EADDR);
+	}
+	if (a->tx_map[lpage] != a->map[lpage]) {
+		// Shadow page exists, update it.
+		return (at45db_read_mod_write(fi, buf, 1, a->pool_page + a->tx_map[lpage], offs, num));
+	}
+	if ((pg = alloc_page(a)) < 0) {
+		return (-EADDR);
+	}
+	at45db_lock(fi);
+	if (offs != 0 || num != fi->pg_size) {
+		if (0 != (err = at45db_load_buf(fi, 1, a->pool_page + a->map[lpage]))) {
+			goto exit;
+		}
+	}
+	if (0 != (err = at45db_write_buf(fi, buf, 1, offs, num))) {
+		goto exit;
+	}
+	if (0 != (err = at45db_store_buf(fi, 1, a->pool_page + pg, TRUE))) {
+		goto exit;
+	}
+	a->tx_map[lpage] = pg;
+exit:
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_atom_commit
+ */
+int at45db_atom_commit(at45db_atom a)
+{
+	at45db fi = a->fi;
+	struct root_hdr hdr;
+	int slot = a->root_slot ^ 1;
+	int err;
+
+	if (!a->tx) {
+		return (0);
+	}
+	hdr.magic = ROOT_MAGIC;
+	hdr.seq = a->seq + 1;
+	hdr.count = a->lp_count;
+	hdr.crc = root_crc(hdr.seq, a->tx_map, a->lp_count);
+	at45db_lock(fi);
+	if (0 != (err = at45db_write_buf(fi, (unsigned char *) &hdr, 2, 0, sizeof(hdr)))) {
+		goto exit;
+	}
+	if (0 != (err = at45db_write_buf(fi, (unsigned char *) a->tx_map, 2, sizeof(hdr),
+	                                 a->lp_count * sizeof(uint16_t)))) {
+		goto exit;
+	}
+	if (0 != (err = at45db_store_buf(fi, 2, a->root_page + slot, TRUE))) {
+		goto exit;
+	}
+	memcpy(a->map, a->tx_map, a->lp_count * sizeof(uint16_t));
+	a->seq = hdr.seq;
+	a->root_slot = slot;
+	a->tx = FALSE;
+exit:
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_atom_abort
+ */
+void at45db_atom_abort(at45db_atom a)
+{
+	a->tx = FALSE;
+}
+
+/**
+ * at45db_atom_read
+ */
+int at45db_atom_read(at45db_atom a, unsigned char *buf, int lpage, int offs, int num)
+{
+	uint16_t *map = (a->tx) ? a->tx_map : a->map;
+
+	if (lpage < 0 || lpage >= a->lp_count) {
+		return (-EADDR);
+	}
+	return (at45db_read_mem(a->fi, buf, a->pool_page + map[lpage], offs, num));
+}
+
+/**
+ * read_root
+ */
+static int read_root(at45db_atom a, int slot, uint32_t *seq)
+{
+	struct root_hdr hdr;
+	int err;
+
+	if (0 != (err = at45db_read_mem(a->fi, (unsigned char *) &hdr, a->root_page + slot, 0,
+	                                sizeof(hdr)))) {
+		return (err);
+	}
+	if (hdr.magic != ROOT_MAGIC || hdr.count != a->lp_count) {
+		return (0);
+	}
+	if (0 != (err = at45db_read_mem(a->fi, (unsigned char *) a->map, a->root_page + slot,
+	                                sizeof(hdr), a->lp_count * sizeof(uint16_t)))) {
+		return (err);
+	}
+	if (hdr.crc != root_crc(hdr.seq, a->map, a->lp_count)) {
+		return (0);
+	}
+	for (int i = 0; i < a->lp_count; i++) {
+		if (a->map[i] >= a->pool_count) {
+			return (0);
+		}
+	}
+	*seq = hdr.seq;
+	return (1);
+}
+
+/**
+ * root_crc
+ */
+static uint16_t root_crc(uint32_t seq, uint16_t *map, int count)
+{
+	uint16_t crc;
+
+	crc = crc_ccit(INIT_CRC_CCITT, (unsigned char *) &seq, sizeof(seq));
+	return (crc_ccit(crc, (unsigned char *) map, count * sizeof(uint16_t)));
+}
+
+/**
+ * alloc_page
+ */
+static int alloc_page(at45db_atom a)
+{
+	int pg, i;
+
+	for (int n = 0; n < a->pool_count; n++) {
+		pg = a->alloc;
+		if (++a->alloc == a->pool_count) {
+			a->alloc = 0;
+		}
+		// Page is free if not used by committed nor transaction map.
+		for (i = 0; i < a->lp_count; i++) {
+			if (a->map[i] == pg || a->tx_map[i] == pg) {
+				break;
+			}
+		}
+		if (i == a->lp_count) {
+			return (pg);
+		}
+	}
+	return (-1);
+}
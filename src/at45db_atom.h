@@ -0,0 +1,113 @@
+/*
+ * at45db_atom.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_ATOM_H
+#define AT45DB_ATOM_H
+
+// Atomic update region descriptor.
+typedef struct at45db_atom_dsc *at45db_atom;
+
+struct at45db_atom_dsc {
+        at45db fi;        // <SetIt>
+        int root_page;    // <SetIt> First of two root record pages.
+        int pool_page;    // <SetIt> First page of shadow pool.
+        int pool_count;   // <SetIt> Count of pages in shadow pool.
+        int lp_count;     // <SetIt> Count of logical pages.
+        uint16_t *map;    // <SetIt> NULL
+        uint16_t *tx_map; // <SetIt> NULL
+        uint32_t seq;     // <SetIt> 0
+        int root_slot;    // <SetIt> 0
+        int alloc;        // <SetIt> 0
+        boolean_t tx;     // <SetIt> FALSE
+};
+
+/**
+ * at45db_atom_mount - mount atomic update region.
+ *
+ * Region consists of two root record pages and pool of physical pages
+ * (pool_count must be greater than lp_count by maximal count of pages
+ * updated in one transaction). Root record maps logical pages to pool pages
+ * and must fit to one page. Empty region is formatted.
+ *
+ * @a: Region instance.
+ *
+ * Returns: 0 - success; -EADDR - bad configuration; -EHW - hardware error;
+ *          -EDATA - write error.
+ */
+int at45db_atom_mount(at45db_atom a);
+
+/**
+ * at45db_atom_begin - begin transaction.
+ *
+ * @a: Region instance.
+ */
+void at45db_atom_begin(at45db_atom a);
+
+/**
+ * at45db_atom_write - write logical page data in transaction.
+ *
+ * First write of logical page in transaction copies page to free pool page
+ * through flash buffer 1 (shadow page), next writes update shadow page.
+ *
+ * @a: Region instance.
+ * @buf: Data buffer.
+ * @lpage: Logical page.
+ * @offs: Data offset in page.
+ * @num: Count of bytes to write.
+ *
+ * Returns: 0 - success; -EADDR - bad address or pool exhausted;
+ *          -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_atom_write(at45db_atom a, unsigned char *buf, int lpage, int offs, int num);
+
+/**
+ * at45db_atom_commit - commit transaction.
+ *
+ * New root record is composed in flash buffer 2 and stored to alternate root
+ * page by one page program.
+ *
+ * @a: Region instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_atom_commit(at45db_atom a);
+
+/**
+ * at45db_atom_abort - abort transaction.
+ *
+ * @a: Region instance.
+ */
+void at45db_atom_abort(at45db_atom a);
+
+/**
+ * at45db_atom_read - read logical page data.
+ *
+ * Inside transaction data written by transaction are read.
+ *
+ * @a: Region instance.
+ * @buf: Buffer for data.
+ * @lpage: Logical page.
+ * @offs: Data offset in page.
+ * @num: Count of bytes to read.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_atom_read(at45db_atom a, unsigned char *buf, int lpage, int offs, int num);
+
+#endif
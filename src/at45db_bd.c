@@ -0,0 +1,277 @@
+/*
+ * at45db_bd.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "at45db.h"
+#include "at45db_bd.h"
+#include <string.h>
+#include <stdint.h>
+#if AT45DB_BD_LFS == 1
+#include "lfs.h"
+#endif
+
+// Count of data bytes in page (power of 2 part).
+#define data_size(fi) ((fi)->pg_size / 33 * 32)
+#define pg_per_block(fi) ((fi)->pg_count / (fi)->bl_count)
+
+static int flush(at45db_bd bd);
+#if AT45DB_BD_LFS == 1
+static int bd_lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                       void *buffer, lfs_size_t size);
+static int bd_lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                       const void *buffer, lfs_size_t size);
+static int bd_lfs_erase(const struct lfs_config *c, lfs_block_t block);
+static int bd_lfs_sync(const struct lfs_config *c);
+static int bd_lfs_err(int err);
+#endif
+
+/**
+ * at45db_bd_sect_count
+ */
+int at45db_bd_sect_count(at45db_bd bd)
+{
+	return (bd->bl_count * pg_per_block(bd->fi) * data_size(bd->fi) / AT45DB_BD_SECT_SIZE);
+}
+
+/**
+ * at45db_bd_sect_per_block
+ */
+int at45db_bd_sect_per_block(at45db_bd bd)
+{
+	return (pg_per_block(bd->fi) * data_size(bd->fi) / AT45DB_BD_SECT_SIZE);
+}
+
+/**
+ * at45db_bd_sect_read
+ */
+int at45db_bd_sect_read(at45db_bd bd, unsigned char *buf, int sect, int count)
+{
+	at45db fi = bd->fi;
+	int dsz = data_size(fi);
+	int adr, page, offs, n, sz, err = 0;
+
+	if (sect < 0 || count < 0 || sect + count > at45db_bd_sect_count(bd)) {
+		return (-EADDR);
+	}
+	adr = sect * AT45DB_BD_SECT_SIZE;
+	n = count * AT45DB_BD_SECT_SIZE;
+	at45db_lock(fi);
+	while (n) {
+		page = bd->start_block * pg_per_block(fi) + adr / dsz;
+		offs = adr % dsz;
+		sz = (dsz - offs < n) ? dsz - offs : n;
+		if (bd->wr_dirty && page == bd->wr_page) {
+			memcpy(buf, bd->wr_buf + offs, sz);
+		} else if (0 != (err = at45db_read_mem(fi, buf, page, offs, sz))) {
+			break;
+		}
+		buf += sz;
+		adr += sz;
+		n -= sz;
+	}
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_bd_sect_write
+ */
+int at45db_bd_sect_write(at45db_bd bd, unsigned char *buf, int sect, int count)
+{
+	at45db fi = bd->fi;
+	int dsz = data_size(fi);
+	int adr, page, offs, n, sz, err = 0;
+
+	if (sect < 0 || count < 0 || sect + count > at45db_bd_sect_count(bd)) {
+		return (-EADDR);
+	}
+	adr = sect * AT45DB_BD_SECT_SIZE;
+	n = count * AT45DB_BD_SECT_SIZE;
+	at45db_lock(fi);
+	if (bd->wr_buf == NULL) {
+		if (NULL == (bd->wr_buf = pvPortMalloc(fi->pg_size))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	while (n) {
+		page = bd->start_block * pg_per_block(fi) + adr / dsz;
+		offs = adr % dsz;
+		sz = (dsz - offs < n) ? dsz - offs : n;
+		if (!bd->wr_dirty || page != bd->wr_page) {
+			if (0 != (err = flush(bd))) {
+				break;
+			}
+			// Load page image, extra bytes are kept when data are overwritten completely.
+			if (sz != dsz) {
+				err = at45db_read_mem(fi, bd->wr_buf, page, 0, fi->pg_size);
+			} else {
+				err = at45db_read_mem(fi, bd->wr_buf + dsz, page, dsz, fi->pg_size - dsz);
+			}
+			if (err) {
+				break;
+			}
+		}
+		memcpy(bd->wr_buf + offs, buf, sz);
+		bd->wr_page = page;
+		bd->wr_dirty = TRUE;
+		buf += sz;
+		adr += sz;
+		n -= sz;
+	}
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_bd_sync
+ */
+int at45db_bd_sync(at45db_bd bd)
+{
+	int err;
+
+	at45db_lock(bd->fi);
+	err = flush(bd);
+	at45db_unlock(bd->fi);
+	return (err);
+}
+
+/**
+ * flush
+ */
+static int flush(at45db_bd bd)
+{
+	int err;
+
+	if (!bd->wr_dirty) {
+		return (0);
+	}
+	if (0 == (err = at45db_write_mem(bd->fi, bd->wr_buf, bd->bfn, bd->wr_page, 0,
+	                                 bd->fi->pg_size))) {
+		bd->wr_dirty = FALSE;
+	}
+	return (err);
+}
+
+#if AT45DB_BD_LFS == 1
+/**
+ * at45db_bd_lfs_cfg
+ */
+void at45db_bd_lfs_cfg(at45db_bd bd, struct lfs_config *cfg)
+{
+	cfg->context = bd;
+	cfg->read = bd_lfs_read;
+	cfg->prog = bd_lfs_prog;
+	cfg->erase = bd_lfs_erase;
+	cfg->sync = bd_lfs_sync;
+	cfg->read_size = 1;
+	cfg->prog_size = bd->fi->pg_size;
+	cfg->block_size = bd->fi->pg_size * pg_per_block(bd->fi);
+	cfg->block_count = bd->bl_count;
+	if (cfg->cache_size == 0) {
+		cfg->cache_size = bd->fi->pg_size;
+	}
+	if (cfg->lookahead_size == 0) {
+		cfg->lookahead_size = 16;
+	}
+	if (cfg->block_cycles == 0) {
+		cfg->block_cycles = 500;
+	}
+}
+
+/**
+ * bd_lfs_read
+ */
+static int bd_lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                       void *buffer, lfs_size_t size)
+{
+	at45db_bd bd = c->context;
+	int page = (bd->start_block + block) * pg_per_block(bd->fi) + off / bd->fi->pg_size;
+
+	// Whole pages are used, data are contiguous across page boundary.
+	return (bd_lfs_err(at45db_read_cont(bd->fi, AT45DB_READ_CONT_HF0, buffer, page,
+	                                    off % bd->fi->pg_size, size)));
+}
+
+/**
+ * bd_lfs_prog
+ */
+static int bd_lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                       const void *buffer, lfs_size_t size)
+{
+	at45db_bd bd = c->context;
+	unsigned char *p = (unsigned char *) (uintptr_t) buffer;
+	int page = (bd->start_block + block) * pg_per_block(bd->fi) + off / bd->fi->pg_size;
+	int err = 0;
+
+	at45db_lock(bd->fi);
+	// Block was erased by bd_lfs_erase(), program without built-in erase.
+	for (lfs_size_t i = 0; i < size; i += bd->fi->pg_size) {
+		if (0 != (err = at45db_write_buf(bd->fi, p + i, bd->bfn, 0, bd->fi->pg_size))) {
+			break;
+		}
+		if (0 != (err = at45db_store_buf(bd->fi, bd->bfn, page++, FALSE))) {
+			break;
+		}
+	}
+	at45db_unlock(bd->fi);
+	return (bd_lfs_err(err));
+}
+
+/**
+ * bd_lfs_erase
+ */
+static int bd_lfs_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	at45db_bd bd = c->context;
+
+	return (bd_lfs_err(at45db_block_erase(bd->fi, bd->start_block + block)));
+}
+
+/**
+ * bd_lfs_sync
+ */
+static int bd_lfs_sync(const struct lfs_config *c)
+{
+	return (0);
+}
+
+/**
+ * bd_lfs_err
+ */
+static int bd_lfs_err(int err)
+{
+	switch (err) {
+	case 0 :
+		return (0);
+	case -EDATA :
+		return (LFS_ERR_CORRUPT);
+	default :
+		return (LFS_ERR_IO);
+	}
+}
+#endif
@@ -0,0 +1,117 @@
+/*
+ * at45db_bd.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_BD_H
+#define AT45DB_BD_H
+
+#ifndef AT45DB_BD_LFS
+  #define AT45DB_BD_LFS 0
+#endif
+
+#define AT45DB_BD_SECT_SIZE 512
+
+// Block device descriptor.
+typedef struct at45db_bd_dsc *at45db_bd;
+
+struct at45db_bd_dsc {
+        at45db fi;        // <SetIt>
+        int bfn;          // <SetIt> Flash buffer used by block device (1 or 2).
+        int start_block;  // <SetIt> First flash block of device.
+        int bl_count;     // <SetIt> Count of flash blocks of device.
+        int wr_page;      // <SetIt> 0
+        boolean_t wr_dirty; // <SetIt> FALSE
+        unsigned char *wr_buf; // <SetIt> NULL
+};
+
+/**
+ * at45db_bd_sect_count - get count of sectors.
+ *
+ * Sector interface maps AT45DB_BD_SECT_SIZE sectors to power of 2 part
+ * of pages (extra bytes are not used).
+ *
+ * @bd: Block device instance.
+ *
+ * Returns: Count of sectors.
+ */
+int at45db_bd_sect_count(at45db_bd bd);
+
+/**
+ * at45db_bd_sect_per_block - get count of sectors in erase block.
+ *
+ * @bd: Block device instance.
+ *
+ * Returns: Count of sectors.
+ */
+int at45db_bd_sect_per_block(at45db_bd bd);
+
+/**
+ * at45db_bd_sect_read - read sectors.
+ *
+ * @bd: Block device instance.
+ * @buf: Buffer for data.
+ * @sect: First sector.
+ * @count: Count of sectors.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_bd_sect_read(at45db_bd bd, unsigned char *buf, int sect, int count);
+
+/**
+ * at45db_bd_sect_write - write sectors.
+ *
+ * Sectors are collected in RAM image of page (write back). Page is written
+ * to main memory when sector of other page is written or by at45db_bd_sync().
+ * Flash buffers can be used by other functions meanwhile.
+ *
+ * @bd: Block device instance.
+ * @buf: Data buffer.
+ * @sect: First sector.
+ * @count: Count of sectors.
+ *
+ * Returns: 0 - success; -EADDR - bad address; -EHW - hardware error;
+ *          -EDATA - write error.
+ */
+int at45db_bd_sect_write(at45db_bd bd, unsigned char *buf, int sect, int count);
+
+/**
+ * at45db_bd_sync - store pending page to main memory.
+ *
+ * @bd: Block device instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_bd_sync(at45db_bd bd);
+
+#if AT45DB_BD_LFS == 1
+struct lfs_config;
+
+/**
+ * at45db_bd_lfs_cfg - set up littlefs configuration.
+ *
+ * Function sets callbacks, context and geometry of littlefs configuration.
+ * Program unit is whole page (including extra bytes), erase unit is flash
+ * block. Other configuration items are set to defaults if zero.
+ *
+ * @bd: Block device instance.
+ * @cfg: littlefs configuration.
+ */
+void at45db_bd_lfs_cfg(at45db_bd bd, struct lfs_config *cfg);
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * at45db_disp.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <queue.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "at45db.h"
+#include "at45db_disp.h"
+
+#ifndef AT45DB_DISP_BUS_COUNT
+  #define AT45DB_DISP_BUS_COUNT 2
+#endif
+#ifndef AT45DB_DISP_QUEUE_SIZE
+  #define AT45DB_DISP_QUEUE_SIZE 8
+#endif
+#ifndef AT45DB_DISP_STACK_SIZE
+  #define AT45DB_DISP_STACK_SIZE configMINIMAL_STACK_SIZE
+#endif
+
+struct disp_bus {
+	spibus spi;
+	QueueHandle_t que;
+};
+
+static struct disp_bus disp_bus[AT45DB_DISP_BUS_COUNT];
+static int disp_bus_cnt;
+
+static void disp_tsk(void *p);
+static int exec_req(struct at45db_req *req);
+
+/**
+ * at45db_disp_add
+ */
+void at45db_disp_add(spibus spi, UBaseType_t prio)
+{
+	struct disp_bus *b;
+
+	if (disp_bus_cnt == AT45DB_DISP_BUS_COUNT) {
+		crit_err_exit(BAD_PARAMETER);
+	}
+	b = &disp_bus[disp_bus_cnt];
+	b->spi = spi;
+	if (NULL == (b->que = xQueueCreate(AT45DB_DISP_QUEUE_SIZE, sizeof(struct at45db_req *)))) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	if (pdPASS != xTaskCreate(disp_tsk, "AT45DISP", AT45DB_DISP_STACK_SIZE, b, prio, NULL)) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	taskENTER_CRITICAL();
+	disp_bus_cnt++;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * at45db_disp_submit
+ */
+int at45db_disp_submit(struct at45db_req *req)
+{
+	for (int i = 0; i < disp_bus_cnt; i++) {
+		if (disp_bus[i].spi == req->fi->spi) {
+			req->done = FALSE;
+			req->tsk = xTaskGetCurrentTaskHandle();
+			xQueueSend(disp_bus[i].que, &req, portMAX_DELAY);
+			return (0);
+		}
+	}
+	return (-EADDR);
+}
+
+/**
+ * at45db_disp_wait
+ */
+int at45db_disp_wait(struct at45db_req *req)
+{
+	while (!req->done) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+	return (req->ret);
+}
+
+/**
+ * disp_tsk
+ */
+static void disp_tsk(void *p)
+{
+	struct disp_bus *b = p;
+	struct at45db_req *req;
+
+	for (;;) {
+		if (pdTRUE != xQueueReceive(b->que, &req, portMAX_DELAY)) {
+			continue;
+		}
+		req->ret = exec_req(req);
+		req->done = TRUE;
+		if (req->cb) {
+			req->cb(req);
+		} else {
+			xTaskNotifyGive(req->tsk);
+		}
+	}
+}
+
+/**
+ * exec_req
+ */
+static int exec_req(struct at45db_req *req)
+{
+	switch (req->op) {
+	case AT45DB_REQ_READ :
+		return (at45db_read_mem(req->fi, req->buf, req->page, req->offs, req->num));
+	case AT45DB_REQ_READ_CONT :
+		return (at45db_read_cont(req->fi, AT45DB_READ_CONT_HF0, req->buf, req->page,
+		                         req->offs, req->num));
+	case AT45DB_REQ_WRITE :
+		return (at45db_write_mem(req->fi, req->buf, req->bfn, req->page, req->offs,
+		                         req->num));
+	case AT45DB_REQ_RMW :
+		return (at45db_read_mod_write(req->fi, req->buf, req->bfn, req->page, req->offs,
+		                              req->num));
+	case AT45DB_REQ_PAGE_ERASE :
+		return (at45db_page_erase(req->fi, req->page));
+	case AT45DB_REQ_BLOCK_ERASE :
+		return (at45db_block_erase(req->fi, req->page));
+	case AT45DB_REQ_CHIP_ERASE :
+		return (at45db_chip_erase(req->fi));
+	default :
+		crit_err_exit(BAD_PARAMETER);
+		return (-EADDR);
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * at45db_disp.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_DISP_H
+#define AT45DB_DISP_H
+
+enum at45db_req_op {
+	AT45DB_REQ_READ,        // at45db_read_mem()
+	AT45DB_REQ_READ_CONT,   // at45db_read_cont() (AT45DB_READ_CONT_HF0)
+	AT45DB_REQ_WRITE,       // at45db_write_mem()
+	AT45DB_REQ_RMW,         // at45db_read_mod_write()
+	AT45DB_REQ_PAGE_ERASE,  // at45db_page_erase()
+	AT45DB_REQ_BLOCK_ERASE, // at45db_block_erase() (page is block number)
+	AT45DB_REQ_CHIP_ERASE   // at45db_chip_erase()
+};
+
+// Dispatcher request.
+struct at45db_req {
+        at45db fi;              // <SetIt>
+        enum at45db_req_op op;  // <SetIt>
+        unsigned char *buf;     // <SetIt>
+        int bfn;                // <SetIt>
+        int page;               // <SetIt>
+        int offs;               // <SetIt>
+        int num;                // <SetIt>
+        void (*cb)(struct at45db_req *req); // <SetIt> NULL - notify submitter task
+        void *arg;              // <SetIt>
+        int ret;                // Result of operation.
+        TaskHandle_t tsk;
+        volatile boolean_t done;
+};
+
+/**
+ * at45db_disp_add - add SPI bus to dispatcher.
+ *
+ * Function creates worker task, which executes requests for flash instances
+ * attached to the bus. Operations on instances on different buses run
+ * concurrently.
+ *
+ * @spi: SPI bus.
+ * @prio: Worker task priority.
+ */
+void at45db_disp_add(spibus spi, UBaseType_t prio);
+
+/**
+ * at45db_disp_submit - submit request.
+ *
+ * Request is executed by worker of bus of flash instance req->fi. Without
+ * callback, the worker notifies submitting task (direct to task notification)
+ * on completion.
+ *
+ * @req: Request (must be valid until completion).
+ *
+ * Returns: 0 - success; -EADDR - bus of instance not added to dispatcher.
+ */
+int at45db_disp_submit(struct at45db_req *req);
+
+/**
+ * at45db_disp_wait - wait for request completion.
+ *
+ * @req: Request submitted by calling task without callback.
+ *
+ * Returns: Result of operation.
+ */
+int at45db_disp_wait(struct at45db_req *req);
+
+#endif
@@ -0,0 +1,562 @@
+/*
+ * at45db_kv.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "crc.h"
+#include "at45db.h"
+#include "at45db_kv.h"
+#include <string.h>
+#include <stdint.h>
+
+#define BLK_MAGIC 0x4B56424C
+#define REC_MAGIC 0x4B56
+#define REC_FREE  0xFFFF
+#define REC_DEL   0x01
+
+#define LOC_EMPTY -1
+#define LOC_DEL   -2
+
+// Block header (at beginning of first page of block).
+struct blk_hdr {
+	uint32_t magic;
+	uint32_t seq;
+};
+
+// Record header, followed by key and value.
+struct rec_hdr {
+	uint16_t magic;
+	uint8_t klen;
+	uint8_t flags;
+	uint16_t vlen;
+	uint16_t crc;
+};
+
+#define pg_per_block(kv) ((kv)->fi->pg_count / (kv)->fi->bl_count)
+#define first_page(kv) ((kv)->start_block * pg_per_block(kv))
+#define block_size(kv) (pg_per_block(kv) * (kv)->fi->pg_size)
+
+static int open_block(at45db_kv kv);
+static int append(at45db_kv kv, unsigned char *rec, int size);
+static int ensure_space(at45db_kv kv, int size);
+static int compact(at45db_kv kv);
+static int scan_block(at45db_kv kv, int b, boolean_t compact);
+static int idx_find(at45db_kv kv, uint32_t h, const void *key, int klen, int *fr);
+static int idx_live(at45db_kv kv, uint32_t h, int loc);
+static int build_rec(at45db_kv kv, const void *key, int klen, const void *val, int vlen,
+                     int flags);
+static boolean_t rec_valid(at45db_kv kv, unsigned char *rec, int room);
+static uint32_t hash(const void *key, int klen);
+static int free_blocks(at45db_kv kv);
+
+/**
+ * at45db_kv_mount
+ */
+int at45db_kv_mount(at45db_kv kv)
+{
+	at45db fi = kv->fi;
+	struct blk_hdr hdr;
+	uint32_t *seq;
+	int b, err = 0;
+
+	if (kv->bl_count < 3 || kv->start_block < 0 || kv->start_block + kv->bl_count > fi->bl_count ||
+	    kv->idx_size <= 0 || (kv->idx_size & (kv->idx_size - 1))) {
+		return (-EADDR);
+	}
+	if (kv->idx == NULL) {
+		if (NULL == (kv->idx = pvPortMalloc(kv->idx_size * sizeof(struct at45db_kv_ent)))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		if (NULL == (kv->buf = pvPortMalloc(fi->pg_size))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	if (NULL == (seq = pvPortMalloc(kv->bl_count * sizeof(uint32_t)))) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	for (int i = 0; i < kv->idx_size; i++) {
+		kv->idx[i].loc = LOC_EMPTY;
+	}
+	at45db_lock(fi);
+	// Find head block (highest sequence number).
+	kv->head = -1;
+	for (b = 0; b < kv->bl_count; b++) {
+		if (0 != (err = at45db_read_cont(fi, AT45DB_READ_CONT_HF0, (unsigned char *) &hdr,
+		                                 first_page(kv) + b * pg_per_block(kv), 0,
+		                                 sizeof(hdr)))) {
+			goto exit;
+		}
+		seq[b] = (hdr.magic == BLK_MAGIC) ? hdr.seq : 0;
+		if (seq[b] && (kv->head < 0 || seq[b] > seq[kv->head])) {
+			kv->head = b;
+		}
+	}
+	if (kv->head < 0) {
+		// Format store.
+		kv->seq = 0;
+		kv->head = kv->tail = kv->bl_count - 1;
+		err = open_block(kv);
+		goto exit;
+	}
+	kv->seq = seq[kv->head];
+	// Tail is oldest block of chain of consecutive sequence numbers.
+	kv->tail = kv->head;
+	for (;;) {
+		b = (kv->tail + kv->bl_count - 1) % kv->bl_count;
+		if (b == kv->head || seq[b] == 0 || seq[b] != seq[kv->tail] - 1) {
+			break;
+		}
+		kv->tail = b;
+	}
+	// Replay records from oldest block.
+	for (b = kv->tail; ; b = (b + 1) % kv->bl_count) {
+		if (0 != (err = scan_block(kv, b, FALSE))) {
+			goto exit;
+		}
+		if (b == kv->head) {
+			break;
+		}
+	}
+exit:
+	at45db_unlock(fi);
+	vPortFree(seq);
+	return (err);
+}
+
+/**
+ * at45db_kv_get
+ */
+int at45db_kv_get(at45db_kv kv, const void *key, int klen, void *val, int size)
+{
+	uint32_t h = hash(key, klen);
+	struct at45db_kv_ent *e;
+	struct rec_hdr *r = (struct rec_hdr *) kv->buf;
+	int i = h & (kv->idx_size - 1), err = -EADDR;
+
+	at45db_lock(kv->fi);
+	for (int n = 0; n < kv->idx_size; n++, i = (i + 1) & (kv->idx_size - 1)) {
+		e = &kv->idx[i];
+		if (e->loc == LOC_EMPTY) {
+			break;
+		}
+		if (e->loc == LOC_DEL || e->hash != h) {
+			continue;
+		}
+		// Whole record is read by one partial page read, key is verified there.
+		if (0 != (err = at45db_read_mem(kv->fi, kv->buf, first_page(kv) + e->loc / kv->fi->pg_size,
+		                                e->loc % kv->fi->pg_size, e->len))) {
+			goto exit;
+		}
+		if (r->klen != klen || 0 != memcmp(kv->buf + sizeof(struct rec_hdr), key, klen)) {
+			err = -EADDR;
+			continue;
+		}
+		if (!rec_valid(kv, kv->buf, e->len)) {
+			err = -EDATA;
+			goto exit;
+		}
+		memcpy(val, kv->buf + sizeof(struct rec_hdr) + klen, (r->vlen < size) ? r->vlen : size);
+		err = r->vlen;
+		goto exit;
+	}
+exit:
+	at45db_unlock(kv->fi);
+	return (err);
+}
+
+/**
+ * at45db_kv_put
+ */
+int at45db_kv_put(at45db_kv kv, const void *key, int klen, const void *val, int vlen)
+{
+	uint32_t h = hash(key, klen);
+	int i, fr, size, loc, err;
+
+	size = sizeof(struct rec_hdr) + klen + vlen;
+	if (klen < 1 || klen > 255 || vlen < 0 ||
+	    size > kv->fi->pg_size - (int) sizeof(struct blk_hdr)) {
+		return (-EADDR);
+	}
+	at45db_lock(kv->fi);
+	if (0 != (err = ensure_space(kv, size))) {
+		goto exit;
+	}
+	if ((i = idx_find(kv, h, key, klen, &fr)) < 0) {
+		if (i != -EADDR) {
+			err = i;
+			goto exit;
+		}
+		if ((i = fr) < 0) {
+			// Index full.
+			err = -EADDR;
+			goto exit;
+		}
+	}
+	build_rec(kv, key, klen, val, vlen, 0);
+	if ((loc = append(kv, kv->buf, size)) < 0) {
+		err = loc;
+		goto exit;
+	}
+	kv->idx[i].hash = h;
+	kv->idx[i].loc = loc;
+	kv->idx[i].len = size;
+exit:
+	at45db_unlock(kv->fi);
+	return (err);
+}
+
+/**
+ * at45db_kv_del
+ */
+int at45db_kv_del(at45db_kv kv, const void *key, int klen)
+{
+	uint32_t h = hash(key, klen);
+	int i, size, loc, err;
+
+	size = sizeof(struct rec_hdr) + klen;
+	at45db_lock(kv->fi);
+	if (0 != (err = ensure_space(kv, size))) {
+		goto exit;
+	}
+	if ((i = idx_find(kv, h, key, klen, NULL)) < 0) {
+		err = i;
+		goto exit;
+	}
+	build_rec(kv, key, klen, NULL, 0, REC_DEL);
+	if ((loc = append(kv, kv->buf, size)) < 0) {
+		err = loc;
+		goto exit;
+	}
+	kv->idx[i].loc = LOC_DEL;
+exit:
+	at45db_unlock(kv->fi);
+	return (err);
+}
+
+/**
+ * open_block
+ */
+static int open_block(at45db_kv kv)
+{
+	struct blk_hdr hdr;
+	int b = (kv->head + 1) % kv->bl_count;
+	int pg = first_page(kv) + b * pg_per_block(kv);
+	int err;
+
+	if (b == kv->tail && kv->head != kv->tail) {
+		return (-EADDR);
+	}
+	if (0 != (err = at45db_block_erase(kv->fi, kv->start_block + b))) {
+		return (err);
+	}
+	// Erased page gives 0xFF image of page in buffer.
+	if (0 != (err = at45db_load_buf(kv->fi, kv->bfn, pg))) {
+		return (err);
+	}
+	hdr.magic = BLK_MAGIC;
+	hdr.seq = ++kv->seq;
+	if (0 != (err = at45db_write_buf(kv->fi, (unsigned char *) &hdr, kv->bfn, 0, sizeof(hdr)))) {
+		return (err);
+	}
+	if (0 != (err = at45db_store_buf(kv->fi, kv->bfn, pg, FALSE))) {
+		return (err);
+	}
+	if (kv->head == kv->tail && kv->seq == 1) {
+		kv->tail = b;
+	}
+	kv->head = b;
+	kv->wr_loc = b * block_size(kv) + sizeof(hdr);
+	return (0);
+}
+
+/**
+ * append
+ */
+static int append(at45db_kv kv, unsigned char *rec, int size)
+{
+	at45db fi = kv->fi;
+	int loc = kv->wr_loc, pg, err;
+
+	if (loc % fi->pg_size + size > fi->pg_size) {
+		// Record does not fit to rest of page.
+		loc += fi->pg_size - loc % fi->pg_size;
+	}
+	if (loc / block_size(kv) != kv->head || loc % block_size(kv) == 0) {
+		if (0 != (err = open_block(kv))) {
+			return (err);
+		}
+		loc = kv->wr_loc;
+	}
+	pg = first_page(kv) + loc / fi->pg_size;
+	// Buffer can be used by others between calls, load is skipped only
+	// if buffer still mirrors page.
+	if (0 != (err = at45db_load_buf(fi, kv->bfn, pg))) {
+		return (err);
+	}
+	if (0 != (err = at45db_write_buf(fi, rec, kv->bfn, loc % fi->pg_size, size))) {
+		return (err);
+	}
+	// Page part behind record is erased, program without erase.
+	if (0 != (err = at45db_store_buf(fi, kv->bfn, pg, FALSE))) {
+		return (err);
+	}
+	kv->wr_loc = loc + size;
+	return (loc);
+}
+
+/**
+ * ensure_space
+ */
+static int ensure_space(at45db_kv kv, int size)
+{
+	int loc = kv->wr_loc, err;
+
+	if (loc % kv->fi->pg_size + size > kv->fi->pg_size) {
+		loc += kv->fi->pg_size - loc % kv->fi->pg_size;
+	}
+	if (loc / block_size(kv) == kv->head && loc % block_size(kv) != 0) {
+		return (0);
+	}
+	// New block needed, keep one free block for compaction.
+	for (int i = 0; free_blocks(kv) < 2 && i < kv->bl_count; i++) {
+		if (0 != (err = compact(kv))) {
+			return (err);
+		}
+	}
+	return ((free_blocks(kv) < 2) ? -EADDR : 0);
+}
+
+/**
+ * compact
+ */
+static int compact(at45db_kv kv)
+{
+	int err;
+
+	if (0 != (err = scan_block(kv, kv->tail, TRUE))) {
+		return (err);
+	}
+	if (0 != (err = at45db_block_erase(kv->fi, kv->start_block + kv->tail))) {
+		return (err);
+	}
+	kv->tail = (kv->tail + 1) % kv->bl_count;
+	return (0);
+}
+
+/**
+ * scan_block
+ */
+static int scan_block(at45db_kv kv, int b, boolean_t cmp)
+{
+	at45db fi = kv->fi;
+	struct rec_hdr r;
+	int offs, loc, size, i, fr, err;
+	uint32_t h;
+
+	if (!cmp && b == kv->head) {
+		kv->wr_loc = b * block_size(kv) + sizeof(struct blk_hdr);
+	}
+	for (int p = 0; p < pg_per_block(kv); p++) {
+		if (0 != (err = at45db_read_cont(fi, AT45DB_READ_CONT_HF0, kv->buf,
+		                                 first_page(kv) + b * pg_per_block(kv) + p, 0,
+		                                 fi->pg_size))) {
+			return (err);
+		}
+		offs = (p == 0) ? sizeof(struct blk_hdr) : 0;
+		while (offs + (int) sizeof(struct rec_hdr) <= fi->pg_size) {
+			// Records are not aligned.
+			memcpy(&r, kv->buf + offs, sizeof(r));
+			if (r.magic == REC_FREE || !rec_valid(kv, kv->buf + offs, fi->pg_size - offs)) {
+				break;
+			}
+			size = sizeof(struct rec_hdr) + r.klen + r.vlen;
+			loc = (b * pg_per_block(kv) + p) * fi->pg_size + offs;
+			h = hash(kv->buf + offs + sizeof(struct rec_hdr), r.klen);
+			if (cmp) {
+				// Move live record to head of log.
+				if ((i = idx_live(kv, h, loc)) >= 0) {
+					if ((loc = append(kv, kv->buf + offs, size)) < 0) {
+						return (loc);
+					}
+					kv->idx[i].loc = loc;
+				}
+			} else {
+				if (b == kv->head) {
+					kv->wr_loc = loc + size;
+				}
+				// Newer record of key replaces older one.
+				i = idx_find(kv, h, kv->buf + offs + sizeof(struct rec_hdr), r.klen, &fr);
+				if (i == -EADDR) {
+					if ((i = fr) < 0) {
+						// Index full, record would be lost by compaction.
+						return (-EDATA);
+					}
+				} else if (i < 0) {
+					return (i);
+				}
+				if (i >= 0) {
+					kv->idx[i].hash = h;
+					kv->idx[i].loc = (r.flags & REC_DEL) ? LOC_DEL : loc;
+					kv->idx[i].len = size;
+				}
+			}
+			offs += size;
+		}
+		if (!cmp && b == kv->head) {
+			// Torn record, rest of page can not be programmed without erase.
+			for (i = offs; i < fi->pg_size && kv->buf[i] == 0xFF; i++) {
+				;
+			}
+			if (i < fi->pg_size) {
+				kv->wr_loc = (b * pg_per_block(kv) + p + 1) * fi->pg_size;
+			}
+		}
+	}
+	return (0);
+}
+
+/**
+ * idx_find
+ */
+static int idx_find(at45db_kv kv, uint32_t h, const void *key, int klen, int *fr)
+{
+	unsigned char k[sizeof(struct rec_hdr) + 255];
+	struct at45db_kv_ent *e;
+	struct rec_hdr r;
+	int i = h & (kv->idx_size - 1), err;
+
+	if (fr) {
+		*fr = -1;
+	}
+	for (int n = 0; n < kv->idx_size; n++, i = (i + 1) & (kv->idx_size - 1)) {
+		e = &kv->idx[i];
+		if (e->loc == LOC_EMPTY) {
+			if (fr && *fr < 0) {
+				*fr = i;
+			}
+			break;
+		}
+		if (e->loc == LOC_DEL) {
+			if (fr && *fr < 0) {
+				*fr = i;
+			}
+			continue;
+		}
+		if (e->hash != h) {
+			continue;
+		}
+		// Verify key stored in flash.
+		if (0 != (err = at45db_read_mem(kv->fi, k, first_page(kv) + e->loc / kv->fi->pg_size,
+		                                e->loc % kv->fi->pg_size,
+		                                sizeof(struct rec_hdr) + klen))) {
+			return (err);
+		}
+		memcpy(&r, k, sizeof(r));
+		if (r.klen == klen && 0 == memcmp(k + sizeof(struct rec_hdr), key, klen)) {
+			return (i);
+		}
+	}
+	return (-EADDR);
+}
+
+/**
+ * idx_live
+ */
+static int idx_live(at45db_kv kv, uint32_t h, int loc)
+{
+	int i = h & (kv->idx_size - 1);
+
+	for (int n = 0; n < kv->idx_size; n++, i = (i + 1) & (kv->idx_size - 1)) {
+		if (kv->idx[i].loc == LOC_EMPTY) {
+			break;
+		}
+		if (kv->idx[i].loc == loc) {
+			return (i);
+		}
+	}
+	return (-1);
+}
+
+/**
+ * build_rec
+ */
+static int build_rec(at45db_kv kv, const void *key, int klen, const void *val, int vlen,
+                     int flags)
+{
+	struct rec_hdr *r = (struct rec_hdr *) kv->buf;
+
+	r->magic = REC_MAGIC;
+	r->klen = klen;
+	r->flags = flags;
+	r->vlen = vlen;
+	memcpy(kv->buf + sizeof(struct rec_hdr), key, klen);
+	if (vlen) {
+		memcpy(kv->buf + sizeof(struct rec_hdr) + klen, val, vlen);
+	}
+	r->crc = crc_ccit(INIT_CRC_CCITT, kv->buf + sizeof(struct rec_hdr), klen + vlen);
+	return (sizeof(struct rec_hdr) + klen + vlen);
+}
+
+/**
+ * rec_valid
+ */
+static boolean_t rec_valid(at45db_kv kv, unsigned char *rec, int room)
+{
+	struct rec_hdr r;
+
+	memcpy(&r, rec, sizeof(r));
+	if (r.magic != REC_MAGIC || r.klen == 0 ||
+	    (int) sizeof(struct rec_hdr) + r.klen + r.vlen > room) {
+		return (FALSE);
+	}
+	return ((r.crc == crc_ccit(INIT_CRC_CCITT, rec + sizeof(struct rec_hdr),
+	                           r.klen + r.vlen)) ? TRUE : FALSE);
+}
+
+/**
+ * hash
+ */
+static uint32_t hash(const void *key, int klen)
+{
+	const unsigned char *p = key;
+	uint32_t h = 2166136261U;
+
+	// FNV-1a.
+	for (int i = 0; i < klen; i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/**
+ * free_blocks
+ */
+static int free_blocks(at45db_kv kv)
+{
+	return (kv->bl_count - ((kv->head - kv->tail + kv->bl_count) % kv->bl_count + 1));
+}
@@ -0,0 +1,105 @@
+/*
+ * at45db_kv.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_KV_H
+#define AT45DB_KV_H
+
+// Index entry.
+struct at45db_kv_ent {
+        uint32_t hash;
+        int32_t loc;  // Record location (-1 - empty, -2 - deleted).
+        uint16_t len; // Record length.
+};
+
+// Key-value store descriptor.
+typedef struct at45db_kv_dsc *at45db_kv;
+
+struct at45db_kv_dsc {
+        at45db fi;          // <SetIt>
+        int bfn;            // <SetIt> Flash buffer used by store (1 or 2).
+        int start_block;    // <SetIt> First flash block of store.
+        int bl_count;       // <SetIt> Count of flash blocks of store (>= 3).
+        int idx_size;       // <SetIt> Count of index entries (power of 2).
+        struct at45db_kv_ent *idx; // <SetIt> NULL
+        unsigned char *buf; // <SetIt> NULL
+        int head;           // <SetIt> 0
+        int tail;           // <SetIt> 0
+        uint32_t seq;       // <SetIt> 0
+        int wr_loc;         // <SetIt> 0
+};
+
+/**
+ * at45db_kv_mount - mount key-value store.
+ *
+ * Records are appended to log in ring of flash blocks. In-RAM hash index
+ * is rebuilt from records read by at45db_read_cont(). Empty store is
+ * formatted.
+ *
+ * @kv: Store instance.
+ *
+ * Returns: 0 - success; -EADDR - bad configuration; -EHW - hardware error;
+ *          -EDATA - erase error or keys do not fit to index (idx_size).
+ */
+int at45db_kv_mount(at45db_kv kv);
+
+/**
+ * at45db_kv_get - get value of key.
+ *
+ * @kv: Store instance.
+ * @key: Key.
+ * @klen: Key length.
+ * @val: Buffer for value.
+ * @size: Size of buffer.
+ *
+ * Returns: Value length (>= 0); -EADDR - key not found; -EHW - hardware error;
+ *          -EDATA - record corrupted.
+ */
+int at45db_kv_get(at45db_kv kv, const void *key, int klen, void *val, int size);
+
+/**
+ * at45db_kv_put - store value of key.
+ *
+ * Page is loaded to flash buffer (skipped when buffer mirrors page), record
+ * is written to buffer and page is programmed without erase. When store has only one free block, live
+ * records of oldest block are moved and block is erased (compaction).
+ *
+ * @kv: Store instance.
+ * @key: Key.
+ * @klen: Key length (1 - 255).
+ * @val: Value.
+ * @vlen: Value length.
+ *
+ * Returns: 0 - success; -EADDR - bad record size or store full;
+ *          -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_kv_put(at45db_kv kv, const void *key, int klen, const void *val, int vlen);
+
+/**
+ * at45db_kv_del - delete key.
+ *
+ * @kv: Store instance.
+ * @key: Key.
+ * @klen: Key length.
+ *
+ * Returns: 0 - success; -EADDR - key not found or store full;
+ *          -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_kv_del(at45db_kv kv, const void *key, int klen);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * at45db_prov.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "at45db.h"
+#include "at45db_prov.h"
+#include <string.h>
+#include <stdint.h>
+
+#ifndef AT45DB_PROV_CHUNK
+#define AT45DB_PROV_CHUNK 64
+#endif
+
+static int erase(at45db fi, int page, int num, boolean_t chip);
+static int fill(at45db fi, int bfn, at45db_prov_rd rd, void *arg, boolean_t *ff,
+                TickType_t *src_time);
+
+/**
+ * at45db_prov
+ */
+int at45db_prov(at45db fi, int page, int num, at45db_prov_rd rd, void *arg, boolean_t chip,
+                struct at45db_prov_stat *st)
+{
+	struct at45db_prov_stat s;
+	TickType_t t0 = xTaskGetTickCount(), t, src;
+	boolean_t ff;
+	int bfn = 1, prev = -1, n, err;
+
+	if (page < 0 || num <= 0 || page + num > fi->pg_count) {
+		return (-EADDR);
+	}
+	memset(&s, 0, sizeof(s));
+	at45db_lock(fi);
+	if (0 != (err = erase(fi, page, num, chip))) {
+		goto exit;
+	}
+	s.erase_time = xTaskGetTickCount() - t0;
+	for (int pg = page; ; pg++) {
+		// Transfer next page while previous one is programmed.
+		t = xTaskGetTickCount();
+		src = s.src_time;
+		if ((n = fill(fi, bfn, rd, arg, &ff, &s.src_time)) < 0) {
+			err = n;
+			break;
+		}
+		// Image stream reading is not part of transfer.
+		s.xfer_time += xTaskGetTickCount() - t - (s.src_time - src);
+		if (n == 0) {
+			break;
+		}
+		if (pg == page + num) {
+			err = -EADDR;
+			break;
+		}
+		if (ff) {
+			s.skipped++;
+			continue;
+		}
+		if (prev >= 0) {
+			t = xTaskGetTickCount();
+			err = at45db_wait_ready(fi);
+			s.wait_time += xTaskGetTickCount() - t;
+			if (err) {
+				break;
+			}
+			t = xTaskGetTickCount();
+			err = at45db_compare_buf(fi, 3 - bfn, prev);
+			s.vfy_time += xTaskGetTickCount() - t;
+			if (err) {
+				break;
+			}
+		}
+		if (0 != (err = at45db_store_buf_start(fi, bfn, pg, FALSE))) {
+			prev = -1;
+			break;
+		}
+		s.pages++;
+		prev = pg;
+		bfn = 3 - bfn;
+	}
+	if (prev >= 0) {
+		// Finish last page, keep first error.
+		t = xTaskGetTickCount();
+		n = at45db_wait_ready(fi);
+		s.wait_time += xTaskGetTickCount() - t;
+		if (n == 0 && err == 0) {
+			t = xTaskGetTickCount();
+			n = at45db_compare_buf(fi, 3 - bfn, prev);
+			s.vfy_time += xTaskGetTickCount() - t;
+		}
+		if (err == 0) {
+			err = n;
+		}
+	}
+exit:
+	at45db_unlock(fi);
+	s.total_time = xTaskGetTickCount() - t0;
+	if (st) {
+		*st = s;
+	}
+	return (err);
+}
+
+/**
+ * erase
+ */
+static int erase(at45db fi, int page, int num, boolean_t chip)
+{
+	int ppb = fi->pg_count / fi->bl_count;
+	int err = 0;
+
+	if (chip) {
+		return (at45db_chip_erase(fi));
+	}
+	for (int pg = page; pg < page + num && !err; ) {
+		if (pg % ppb == 0 && pg + ppb <= page + num) {
+			err = at45db_block_erase(fi, pg / ppb);
+			pg += ppb;
+		} else {
+			err = at45db_page_erase(fi, pg);
+			pg++;
+		}
+	}
+	return (err);
+}
+
+/**
+ * fill
+ */
+static int fill(at45db fi, int bfn, at45db_prov_rd rd, void *arg, boolean_t *ff,
+                TickType_t *src_time)
+{
+	unsigned char buf[AT45DB_PROV_CHUNK];
+	TickType_t t;
+	int offs = 0, n, err;
+	boolean_t end = FALSE;
+
+	*ff = TRUE;
+	while (offs < fi->pg_size) {
+		n = (fi->pg_size - offs < AT45DB_PROV_CHUNK) ? fi->pg_size - offs : AT45DB_PROV_CHUNK;
+		if (!end) {
+			t = xTaskGetTickCount();
+			err = rd(arg, buf, n);
+			*src_time += xTaskGetTickCount() - t;
+			if (err < 0) {
+				return (err);
+			}
+			if (err > n) {
+				crit_err_exit(BAD_PARAMETER);
+			}
+			if (err == 0) {
+				if (offs == 0) {
+					return (0);
+				}
+				end = TRUE;
+			}
+			n = (err) ? err : n;
+		}
+		if (end) {
+			// Pad last page of image.
+			memset(buf, 0xFF, n);
+		}
+		for (int i = 0; i < n && *ff; i++) {
+			if (buf[i] != 0xFF) {
+				*ff = FALSE;
+			}
+		}
+		if (0 != (err = at45db_write_buf(fi, buf, bfn, offs, n))) {
+			return (err);
+		}
+		offs += n;
+	}
+	return (offs);
+}
@@ -0,0 +1,70 @@
+/*
+ * at45db_prov.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_PROV_H
+#define AT45DB_PROV_H
+
+// Provisioning statistics (times in ticks).
+struct at45db_prov_stat {
+        unsigned int pages;     // Programmed pages.
+        unsigned int skipped;   // Skipped 0xFF pages.
+        TickType_t erase_time;  // Erase phase.
+        TickType_t src_time;    // Reading of image stream.
+        TickType_t xfer_time;   // Transfers to flash buffers (without src_time).
+        TickType_t wait_time;   // Waiting for end of programming.
+        TickType_t vfy_time;    // Buffer to page compares.
+        TickType_t total_time;  // Whole provisioning.
+};
+
+/**
+ * at45db_prov_rd - image stream read function.
+ *
+ * @arg: User argument.
+ * @buf: Buffer for data.
+ * @num: Count of bytes requested.
+ *
+ * Returns: Count of bytes read (0 - end of image, at most num); negative error code.
+ */
+typedef int (*at45db_prov_rd)(void *arg, unsigned char *buf, int num);
+
+/**
+ * at45db_prov - program image to flash.
+ *
+ * Region is erased up front (chip erase or block erase, page erase for
+ * partially used blocks). Image pages are written alternately to flash
+ * buffers, transfer of page to one buffer overlaps programming of previous
+ * page from other buffer. Programmed page is verified by buffer to page
+ * compare. All 0xFF pages are skipped.
+ *
+ * @fi: Flash instance.
+ * @page: First page of region.
+ * @num: Count of region pages.
+ * @rd: Image stream read function.
+ * @arg: User argument of read function.
+ * @chip: TRUE - erase whole chip; FALSE - erase region only.
+ * @st: Pointer to storage for statistics or NULL.
+ *
+ * Returns: 0 - success; -EADDR - bad address or image larger than region;
+ *          -EHW - hardware error; -EDATA - erase, write or verify error;
+ *          negative error code of read function.
+ */
+int at45db_prov(at45db fi, int page, int num, at45db_prov_rd rd, void *arg, boolean_t chip,
+                struct at45db_prov_stat *st);
+
+#endif
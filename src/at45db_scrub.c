@@ -0,0 +1,102 @@
+/*
+ * at45db_scrub.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "crc.h"
+#include "at45db.h"
+#include "at45db_scrub.h"
+#include <string.h>
+#include <stdint.h>
+
+#ifndef AT45DB_SCRUB_CHUNK
+  #define AT45DB_SCRUB_CHUNK 4
+#endif
+#ifndef AT45DB_SCRUB_READ
+  #define AT45DB_SCRUB_READ AT45DB_READ_CONT_HF0
+#endif
+
+/**
+ * at45db_scrub
+ */
+int at45db_scrub(at45db fi, int start, int num, at45db_scrub_chk *chk,
+                 at45db_scrub_bad *bad, void *arg)
+{
+	unsigned char *buf;
+	int n, err, cnt = 0;
+
+	if (start < 0 || num < 0 || start + num > fi->pg_count) {
+		return (-EADDR);
+	}
+	if (NULL == (buf = pvPortMalloc(AT45DB_SCRUB_CHUNK * fi->pg_size))) {
+		crit_err_exit(MALLOC_ERROR);
+	}
+	while (num) {
+		n = (num < AT45DB_SCRUB_CHUNK) ? num : AT45DB_SCRUB_CHUNK;
+		if (0 != (err = at45db_read_cont(fi, AT45DB_SCRUB_READ, buf, start, 0,
+		                                 n * fi->pg_size))) {
+			cnt = err;
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (!chk(fi, start + i, buf + i * fi->pg_size, arg)) {
+				cnt++;
+				if (bad) {
+					bad(fi, start + i, arg);
+				}
+			}
+		}
+		start += n;
+		num -= n;
+	}
+	vPortFree(buf);
+	return (cnt);
+}
+
+/**
+ * at45db_scrub_chk_crc
+ */
+boolean_t at45db_scrub_chk_crc(at45db fi, int page, unsigned char *data, void *arg)
+{
+	uint16_t crc;
+
+	memcpy(&crc, data + fi->pg_size - 2, 2);
+	return ((crc == crc_ccit(INIT_CRC_CCITT, data, fi->pg_size - 2)) ? TRUE : FALSE);
+}
+
+/**
+ * at45db_scrub_chk_erased
+ */
+boolean_t at45db_scrub_chk_erased(at45db fi, int page, unsigned char *data, void *arg)
+{
+	for (int i = 0; i < fi->pg_size; i++) {
+		if (data[i] != 0xFF) {
+			return (FALSE);
+		}
+	}
+	return (TRUE);
+}
@@ -0,0 +1,75 @@
+/*
+ * at45db_scrub.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_SCRUB_H
+#define AT45DB_SCRUB_H
+
+/**
+ * Page check function.
+ *
+ * @fi: Flash instance.
+ * @page: Page number.
+ * @data: Page data (fi->pg_size bytes).
+ * @arg: User argument.
+ *
+ * Returns: TRUE - page ok; FALSE - bad page.
+ */
+typedef boolean_t at45db_scrub_chk(at45db fi, int page, unsigned char *data, void *arg);
+
+/**
+ * Bad page report function.
+ *
+ * @fi: Flash instance.
+ * @page: Page number.
+ * @arg: User argument.
+ */
+typedef void at45db_scrub_bad(at45db fi, int page, void *arg);
+
+/**
+ * at45db_scrub - check integrity of flash pages.
+ *
+ * Pages are streamed by at45db_read_cont() in chunks of AT45DB_SCRUB_CHUNK
+ * pages and every page of chunk is checked by check function.
+ *
+ * @fi: Flash instance.
+ * @start: First page.
+ * @num: Count of pages.
+ * @chk: Page check function.
+ * @bad: Bad page report function or NULL.
+ * @arg: User argument of check and report functions.
+ *
+ * Returns: Count of bad pages (>= 0); -EADDR - bad address; -EHW - hardware error.
+ */
+int at45db_scrub(at45db fi, int start, int num, at45db_scrub_chk *chk,
+                 at45db_scrub_bad *bad, void *arg);
+
+/**
+ * at45db_scrub_chk_crc - check page CRC.
+ *
+ * Last two bytes of page contain CRC-CCITT of preceding page bytes
+ * (page format of at45db_rw_test()).
+ */
+boolean_t at45db_scrub_chk_crc(at45db fi, int page, unsigned char *data, void *arg);
+
+/**
+ * at45db_scrub_chk_erased - check erased page (0xFF pattern).
+ */
+boolean_t at45db_scrub_chk_erased(at45db fi, int page, unsigned char *data, void *arg);
+
+#endif
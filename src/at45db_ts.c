@@ -0,0 +1,330 @@
+/*
+ * at45db_ts.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "at45db.h"
+#include "at45db_ts.h"
+#include <string.h>
+#include <stdint.h>
+
+#define TS_EMPTY 0xFFFFFFFF
+
+// Page summary at end of page.
+struct pg_sum {
+	uint32_t min;
+	uint32_t max;
+	uint32_t seq;
+};
+
+#define data_size(ts) ((ts)->fi->pg_size - (int) sizeof(struct pg_sum))
+#define rec_per_page(ts) (data_size(ts) / (ts)->rec_size)
+#define page_count(ts) (((ts)->head - (ts)->tail + (ts)->pg_num) % (ts)->pg_num + 1)
+#define phys_page(ts, i) (((ts)->tail + (i)) % (ts)->pg_num)
+
+static int store_page(at45db_ts ts);
+static int rd_page(at45db_ts ts, int p, int offs, unsigned char *buf, int num);
+static int rd_sum(at45db_ts ts, int p, struct pg_sum *sum);
+static int rd_time(at45db_ts ts, int p, int slot, uint32_t *t);
+static int find_slot(at45db_ts ts, int p, int cnt, uint32_t t, int *slot);
+
+/**
+ * at45db_ts_mount
+ */
+int at45db_ts_mount(at45db_ts ts)
+{
+	at45db fi = ts->fi;
+	struct pg_sum s0, s;
+	int lo, hi, mid, err;
+
+	if (ts->pg_num < 2 || ts->start_page < 0 || ts->start_page + ts->pg_num > fi->pg_count ||
+	    ts->rec_size < 5 || ts->rec_size > data_size(ts)) {
+		return (-EADDR);
+	}
+	if (ts->buf == NULL) {
+		if (NULL == (ts->buf = pvPortMalloc(data_size(ts)))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	if (ts->img == NULL) {
+		if (NULL == (ts->img = pvPortMalloc(fi->pg_size))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	memset(ts->img, 0xFF, fi->pg_size);
+	ts->head = ts->tail = ts->cnt = ts->synced = 0;
+	ts->hmin = ts->hmax = ts->seq = 0;
+	at45db_lock(fi);
+	if (0 != (err = rd_sum(ts, 0, &s0))) {
+		goto exit;
+	}
+	if (s0.seq == TS_EMPTY) {
+		// Empty ring.
+		goto exit;
+	}
+	// Pages from first one to head have sequence number greater than first
+	// page, following pages are erased or older (timestamps can be equal).
+	lo = 0;
+	hi = ts->pg_num;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (0 != (err = rd_sum(ts, mid, &s))) {
+			goto exit;
+		}
+		if (s.seq != TS_EMPTY && s.seq >= s0.seq) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	ts->head = lo;
+	if (0 != (err = rd_sum(ts, lo, &s))) {
+		goto exit;
+	}
+	ts->seq = s.seq;
+	if (lo + 1 < ts->pg_num) {
+		if (0 != (err = rd_sum(ts, lo + 1, &s))) {
+			goto exit;
+		}
+		ts->tail = (s.seq != TS_EMPTY) ? lo + 1 : 0;
+	}
+	// Continue in head page.
+	if (0 != (err = at45db_read_mem(fi, ts->img, ts->start_page + ts->head, 0, fi->pg_size))) {
+		goto exit;
+	}
+	if (0 != (err = find_slot(ts, ts->head, rec_per_page(ts), TS_EMPTY, &ts->cnt))) {
+		goto exit;
+	}
+	ts->synced = ts->cnt;
+	// Free slots can hold torn record.
+	memset(ts->img + ts->cnt * ts->rec_size, 0xFF, data_size(ts) - ts->cnt * ts->rec_size);
+	if (ts->cnt) {
+		if (0 != (err = rd_time(ts, ts->head, 0, &ts->hmin))) {
+			goto exit;
+		}
+		err = rd_time(ts, ts->head, ts->cnt - 1, &ts->hmax);
+	}
+exit:
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_ts_append
+ */
+int at45db_ts_append(at45db_ts ts, uint32_t t, const void *data)
+{
+	int err;
+
+	if (t == TS_EMPTY || t < ts->hmax) {
+		return (-EADDR);
+	}
+	at45db_lock(ts->fi);
+	if (ts->cnt == rec_per_page(ts)) {
+		// Full page not programmed yet (failed store).
+		if (ts->synced != ts->cnt && 0 != (err = store_page(ts))) {
+			goto exit;
+		}
+		// Next page, oldest page is overwritten when ring is full.
+		ts->head = (ts->head + 1) % ts->pg_num;
+		if (ts->head == ts->tail) {
+			ts->tail = (ts->tail + 1) % ts->pg_num;
+		}
+		ts->cnt = ts->synced = 0;
+		ts->seq++;
+		memset(ts->img, 0xFF, ts->fi->pg_size);
+	}
+	memcpy(ts->img + ts->cnt * ts->rec_size, &t, sizeof(t));
+	memcpy(ts->img + ts->cnt * ts->rec_size + sizeof(t), data, ts->rec_size - sizeof(t));
+	if (ts->cnt++ == 0) {
+		ts->hmin = t;
+	}
+	ts->hmax = t;
+	if (ts->cnt == rec_per_page(ts)) {
+		err = store_page(ts);
+	} else {
+		err = 0;
+	}
+exit:
+	at45db_unlock(ts->fi);
+	return (err);
+}
+
+/**
+ * at45db_ts_sync
+ */
+int at45db_ts_sync(at45db_ts ts)
+{
+	int err = 0;
+
+	at45db_lock(ts->fi);
+	if (ts->cnt != ts->synced) {
+		err = store_page(ts);
+	}
+	at45db_unlock(ts->fi);
+	return (err);
+}
+
+/**
+ * at45db_ts_query
+ */
+int at45db_ts_query(at45db_ts ts, uint32_t t1, uint32_t t2, at45db_ts_cb cb, void *arg)
+{
+	struct pg_sum s;
+	unsigned char *r;
+	uint32_t t;
+	int lo, hi, mid, p, cnt, slot, n = 0, err;
+
+	at45db_lock(ts->fi);
+	// Find first page with records not older than t1.
+	lo = 0;
+	hi = page_count(ts);
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		p = phys_page(ts, mid);
+		if (p == ts->head) {
+			s.max = ts->hmax;
+		} else if (0 != (err = rd_sum(ts, p, &s))) {
+			goto exit;
+		}
+		if (s.max >= t1) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	if (lo == page_count(ts)) {
+		err = 0;
+		goto exit;
+	}
+	p = phys_page(ts, lo);
+	if (0 != (err = find_slot(ts, p, (p == ts->head) ? ts->cnt : rec_per_page(ts), t1, &slot))) {
+		goto exit;
+	}
+	for (int i = lo; i < page_count(ts); i++, slot = 0) {
+		p = phys_page(ts, i);
+		cnt = (p == ts->head) ? ts->cnt : rec_per_page(ts);
+		if (slot >= cnt) {
+			continue;
+		}
+		if (0 != (err = rd_page(ts, p, slot * ts->rec_size, ts->buf,
+		                        (cnt - slot) * ts->rec_size))) {
+			goto exit;
+		}
+		for (r = ts->buf; slot < cnt; slot++, r += ts->rec_size) {
+			memcpy(&t, r, sizeof(t));
+			if (t > t2) {
+				err = 0;
+				goto exit;
+			}
+			n++;
+			if (!cb(arg, t, r + sizeof(t))) {
+				err = 0;
+				goto exit;
+			}
+		}
+	}
+	err = 0;
+exit:
+	at45db_unlock(ts->fi);
+	return ((err) ? err : n);
+}
+
+/**
+ * store_page
+ */
+static int store_page(at45db_ts ts)
+{
+	struct pg_sum s;
+	int err;
+
+	s.min = ts->hmin;
+	s.max = ts->hmax;
+	s.seq = ts->seq;
+	memcpy(ts->img + data_size(ts), &s, sizeof(s));
+	// Whole page image, flash buffer can be used by others.
+	if (0 != (err = at45db_write_mem(ts->fi, ts->img, ts->bfn, ts->start_page + ts->head, 0,
+	                                 ts->fi->pg_size))) {
+		return (err);
+	}
+	ts->synced = ts->cnt;
+	return (0);
+}
+
+/**
+ * rd_page
+ */
+static int rd_page(at45db_ts ts, int p, int offs, unsigned char *buf, int num)
+{
+	if (p == ts->head) {
+		// Head page is kept in RAM image.
+		memcpy(buf, ts->img + offs, num);
+		return (0);
+	}
+	return (at45db_read_cont(ts->fi, AT45DB_READ_CONT_HF0, buf, ts->start_page + p, offs, num));
+}
+
+/**
+ * rd_sum
+ */
+static int rd_sum(at45db_ts ts, int p, struct pg_sum *sum)
+{
+	return (at45db_read_mem(ts->fi, (unsigned char *) sum, ts->start_page + p, data_size(ts),
+	                        sizeof(struct pg_sum)));
+}
+
+/**
+ * rd_time
+ */
+static int rd_time(at45db_ts ts, int p, int slot, uint32_t *t)
+{
+	return (rd_page(ts, p, slot * ts->rec_size, (unsigned char *) t, sizeof(uint32_t)));
+}
+
+/**
+ * find_slot
+ */
+static int find_slot(at45db_ts ts, int p, int cnt, uint32_t t, int *slot)
+{
+	uint32_t v;
+	int lo = 0, hi = cnt, mid, err;
+
+	// First record with timestamp not less than t.
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (0 != (err = rd_time(ts, p, mid, &v))) {
+			return (err);
+		}
+		if (v >= t) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	*slot = lo;
+	return (0);
+}
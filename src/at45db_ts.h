@@ -0,0 +1,108 @@
+/*
+ * at45db_ts.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_TS_H
+#define AT45DB_TS_H
+
+// Time-series ring descriptor.
+typedef struct at45db_ts_dsc *at45db_ts;
+
+struct at45db_ts_dsc {
+        at45db fi;          // <SetIt>
+        int bfn;            // <SetIt> Flash buffer used by ring (1 or 2).
+        int start_page;     // <SetIt> First flash page of ring.
+        int pg_num;         // <SetIt> Count of flash pages of ring (>= 2).
+        int rec_size;       // <SetIt> Record size (4 byte timestamp and data).
+        unsigned char *buf; // <SetIt> NULL
+        unsigned char *img; // <SetIt> NULL
+        int head;           // <SetIt> 0
+        int tail;           // <SetIt> 0
+        int cnt;            // <SetIt> 0
+        int synced;         // <SetIt> 0
+        uint32_t hmin;      // <SetIt> 0
+        uint32_t hmax;      // <SetIt> 0
+        uint32_t seq;       // <SetIt> 0
+};
+
+/**
+ * at45db_ts_cb - range query callback.
+ *
+ * @arg: User argument.
+ * @t: Record timestamp.
+ * @data: Record data (rec_size - 4 bytes).
+ *
+ * Returns: TRUE - continue; FALSE - stop query.
+ */
+typedef boolean_t (*at45db_ts_cb)(void *arg, uint32_t t, const unsigned char *data);
+
+/**
+ * at45db_ts_mount - mount time-series ring.
+ *
+ * Records with nondecreasing timestamps are packed into pages. Minimal and
+ * maximal timestamp and sequence number of page are kept in last 12 bytes
+ * of page. Head page is found by binary search of sequence numbers.
+ *
+ * @ts: Ring instance.
+ *
+ * Returns: 0 - success; -EADDR - bad configuration; -EHW - hardware error.
+ */
+int at45db_ts_mount(at45db_ts ts);
+
+/**
+ * at45db_ts_append - append record.
+ *
+ * Record is written to RAM image of head page, page is programmed when full.
+ * Page which failed to program is stored again before next page is started.
+ * Oldest page is overwritten when ring is full.
+ *
+ * @ts: Ring instance.
+ * @t: Timestamp (0 - 0xFFFFFFFE, not less than previous one).
+ * @data: Record data (rec_size - 4 bytes).
+ *
+ * Returns: 0 - success; -EADDR - bad timestamp; -EHW - hardware error;
+ *          -EDATA - write error.
+ */
+int at45db_ts_append(at45db_ts ts, uint32_t t, const void *data);
+
+/**
+ * at45db_ts_sync - program partially filled head page.
+ *
+ * @ts: Ring instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_ts_sync(at45db_ts ts);
+
+/**
+ * at45db_ts_query - get records in time range.
+ *
+ * First record is found by binary search of page summaries and records of
+ * page. Records of each page are then read by one at45db_read_cont().
+ *
+ * @ts: Ring instance.
+ * @t1: Start of range.
+ * @t2: End of range (included).
+ * @cb: Callback called for each record.
+ * @arg: User argument of callback.
+ *
+ * Returns: Count of records (>= 0); -EHW - hardware error.
+ */
+int at45db_ts_query(at45db_ts ts, uint32_t t1, uint32_t t2, at45db_ts_cb cb, void *arg);
+
+#endif
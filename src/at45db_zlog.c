@@ -0,0 +1,380 @@
+/*
+ * at45db_zlog.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <gentyp.h>
+#include "sysconf.h"
+#include "board.h"
+#include "msgconf.h"
+#include "criterr.h"
+#include "hwerr.h"
+#include "spi.h"
+#include "crc.h"
+#include "at45db.h"
+#include "at45db_zlog.h"
+#include <string.h>
+#include <stdint.h>
+
+#ifndef AT45DB_ZLOG_CHUNK
+#define AT45DB_ZLOG_CHUNK 32
+#endif
+
+#define PG_MAGIC 0x5A4C
+
+#define MIN_MATCH 3
+#define MAX_MATCH 18
+#define MAX_DIST 4096
+
+// Page header, followed by compressed data.
+struct pg_hdr {
+	uint16_t magic;
+	uint16_t clen;
+	uint32_t seq;
+	uint16_t rlen;
+	uint16_t crc;
+};
+
+// Compressed data reader.
+struct zrd {
+	at45db fi;
+	int page;
+	int offs;
+	int end;
+	int n;
+	int i;
+	unsigned char b[AT45DB_ZLOG_CHUNK];
+};
+
+static int encode(at45db_zlog zl, boolean_t final);
+static int match(at45db_zlog zl, int *dist);
+static void put_grp(at45db_zlog zl);
+static int flush(at45db_zlog zl);
+static int rd_byte(struct zrd *r);
+
+/**
+ * at45db_zlog_mount
+ */
+int at45db_zlog_mount(at45db_zlog zl)
+{
+	at45db fi = zl->fi;
+	struct pg_hdr hdr;
+	boolean_t valid = FALSE;
+	int err = 0;
+
+	if (zl->pg_num < 2 || zl->start_page < 0 || zl->start_page + zl->pg_num > fi->pg_count ||
+	    zl->win < 64 || zl->win > MAX_DIST) {
+		return (-EADDR);
+	}
+	if (zl->raw == NULL) {
+		if (NULL == (zl->raw = pvPortMalloc(zl->win))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+		if (NULL == (zl->pg = pvPortMalloc(fi->pg_size))) {
+			crit_err_exit(MALLOC_ERROR);
+		}
+	}
+	zl->fill = zl->enc = zl->offs = 0;
+	zl->grp_len = zl->grp_cnt = 0;
+	zl->head = zl->pg_num - 1;
+	zl->seq = zl->tail_seq = 1;
+	at45db_lock(fi);
+	for (int pg = 0; pg < zl->pg_num; pg++) {
+		if (0 != (err = at45db_read_mem(fi, (unsigned char *) &hdr, zl->start_page + pg, 0,
+		                                sizeof(hdr)))) {
+			goto exit;
+		}
+		if (hdr.magic != PG_MAGIC || hdr.clen > fi->pg_size - sizeof(hdr) ||
+		    hdr.rlen > zl->win) {
+			continue;
+		}
+		if (!valid || hdr.seq >= zl->seq) {
+			zl->seq = hdr.seq + 1;
+			zl->head = pg;
+		}
+		if (!valid || hdr.seq < zl->tail_seq) {
+			zl->tail_seq = hdr.seq;
+		}
+		valid = TRUE;
+	}
+exit:
+	at45db_unlock(fi);
+	return (err);
+}
+
+/**
+ * at45db_zlog_write
+ */
+int at45db_zlog_write(at45db_zlog zl, const void *data, int len)
+{
+	const unsigned char *p = data;
+	int n, err = 0;
+
+	at45db_lock(zl->fi);
+	while (len > 0) {
+		n = (len < zl->win - zl->fill) ? len : zl->win - zl->fill;
+		memcpy(zl->raw + zl->fill, p, n);
+		zl->fill += n;
+		p += n;
+		len -= n;
+		if (0 != (err = encode(zl, FALSE))) {
+			goto exit;
+		}
+		if (zl->fill == zl->win) {
+			// Raw data of page complete.
+			if (0 != (err = encode(zl, TRUE))) {
+				goto exit;
+			}
+			if (0 != (err = flush(zl))) {
+				goto exit;
+			}
+		}
+	}
+exit:
+	at45db_unlock(zl->fi);
+	return (err);
+}
+
+/**
+ * at45db_zlog_sync
+ */
+int at45db_zlog_sync(at45db_zlog zl)
+{
+	int err;
+
+	at45db_lock(zl->fi);
+	if (0 == (err = encode(zl, TRUE))) {
+		err = flush(zl);
+	}
+	at45db_unlock(zl->fi);
+	return (err);
+}
+
+/**
+ * at45db_zlog_pages
+ */
+int at45db_zlog_pages(at45db_zlog zl)
+{
+	return (zl->seq - zl->tail_seq);
+}
+
+/**
+ * at45db_zlog_read
+ */
+int at45db_zlog_read(at45db_zlog zl, int idx, void *buf, int size)
+{
+	struct zrd r;
+	struct pg_hdr hdr;
+	unsigned char *out = buf;
+	int o = 0, flg, b1, b2, dist, len, err;
+
+	if (idx < 0 || idx >= at45db_zlog_pages(zl)) {
+		return (-EADDR);
+	}
+	r.fi = zl->fi;
+	r.page = zl->start_page + (zl->head + zl->pg_num -
+	                           (zl->seq - 1 - (zl->tail_seq + idx)) % zl->pg_num) % zl->pg_num;
+	at45db_lock(zl->fi);
+	if (0 != (err = at45db_read_mem(zl->fi, (unsigned char *) &hdr, r.page, 0, sizeof(hdr)))) {
+		goto exit;
+	}
+	if (hdr.magic != PG_MAGIC || hdr.seq != zl->tail_seq + idx ||
+	    hdr.clen > zl->fi->pg_size - sizeof(hdr)) {
+		err = -EDATA;
+		goto exit;
+	}
+	if (hdr.rlen > size) {
+		err = -EADDR;
+		goto exit;
+	}
+	r.offs = sizeof(hdr);
+	r.end = sizeof(hdr) + hdr.clen;
+	r.n = r.i = 0;
+	while (o < hdr.rlen) {
+		if ((flg = rd_byte(&r)) < 0) {
+			err = flg;
+			goto exit;
+		}
+		for (int i = 0; i < 8 && o < hdr.rlen; i++) {
+			if (flg & (1 << i)) {
+				if ((b1 = rd_byte(&r)) < 0) {
+					err = b1;
+					goto exit;
+				}
+				if ((b2 = rd_byte(&r)) < 0) {
+					err = b2;
+					goto exit;
+				}
+				dist = ((b1 << 4) | (b2 >> 4)) + 1;
+				len = (b2 & 0x0F) + MIN_MATCH;
+				if (dist > o || o + len > hdr.rlen) {
+					err = -EDATA;
+					goto exit;
+				}
+				// Match can overlap with copied data.
+				for (; len; len--, o++) {
+					out[o] = out[o - dist];
+				}
+			} else {
+				if ((b1 = rd_byte(&r)) < 0) {
+					err = b1;
+					goto exit;
+				}
+				out[o++] = b1;
+			}
+		}
+	}
+	err = (hdr.crc == crc_ccit(INIT_CRC_CCITT, out, hdr.rlen)) ? hdr.rlen : -EDATA;
+exit:
+	at45db_unlock(zl->fi);
+	return (err);
+}
+
+/**
+ * encode
+ */
+static int encode(at45db_zlog zl, boolean_t final)
+{
+	int len, dist, need, err;
+
+	while (zl->enc < zl->fill && (final || zl->fill - zl->enc >= MAX_MATCH)) {
+		len = match(zl, &dist);
+		need = (len >= MIN_MATCH) ? 2 : 1;
+		if (zl->grp_cnt == 0) {
+			need++;
+		}
+		if ((int) sizeof(struct pg_hdr) + zl->offs + zl->grp_len + need > zl->fi->pg_size) {
+			// Page full, window restarts with next page.
+			if (0 != (err = flush(zl))) {
+				return (err);
+			}
+			continue;
+		}
+		if (zl->grp_cnt == 0) {
+			zl->grp[0] = 0;
+			zl->grp_len = 1;
+		}
+		if (len >= MIN_MATCH) {
+			zl->grp[0] |= 1 << zl->grp_cnt;
+			zl->grp[zl->grp_len++] = (dist - 1) >> 4;
+			zl->grp[zl->grp_len++] = ((dist - 1) << 4) | (len - MIN_MATCH);
+		} else {
+			zl->grp[zl->grp_len++] = zl->raw[zl->enc];
+			len = 1;
+		}
+		zl->enc += len;
+		if (++zl->grp_cnt == 8) {
+			put_grp(zl);
+		}
+	}
+	return (0);
+}
+
+/**
+ * match
+ */
+static int match(at45db_zlog zl, int *dist)
+{
+	unsigned char *p = zl->raw + zl->enc;
+	int max, best = 0, l;
+
+	max = (zl->fill - zl->enc < MAX_MATCH) ? zl->fill - zl->enc : MAX_MATCH;
+	for (int s = zl->enc - 1; s >= 0 && zl->enc - s <= MAX_DIST; s--) {
+		for (l = 0; l < max && zl->raw[s + l] == p[l]; l++) {
+			;
+		}
+		if (l > best) {
+			best = l;
+			*dist = zl->enc - s;
+			if (best == max) {
+				break;
+			}
+		}
+	}
+	return (best);
+}
+
+/**
+ * put_grp
+ */
+static void put_grp(at45db_zlog zl)
+{
+	memcpy(zl->pg + sizeof(struct pg_hdr) + zl->offs, zl->grp, zl->grp_len);
+	zl->offs += zl->grp_len;
+	zl->grp_len = zl->grp_cnt = 0;
+}
+
+/**
+ * flush
+ */
+static int flush(at45db_zlog zl)
+{
+	struct pg_hdr hdr;
+	int pg, err;
+
+	if (zl->grp_cnt) {
+		put_grp(zl);
+	}
+	if (zl->offs == 0) {
+		return (0);
+	}
+	hdr.magic = PG_MAGIC;
+	hdr.clen = zl->offs;
+	hdr.seq = zl->seq;
+	hdr.rlen = zl->enc;
+	hdr.crc = crc_ccit(INIT_CRC_CCITT, zl->raw, zl->enc);
+	memcpy(zl->pg, &hdr, sizeof(hdr));
+	pg = (zl->head + 1) % zl->pg_num;
+	if (0 != (err = at45db_write_mem(zl->fi, zl->pg, zl->bfn, zl->start_page + pg, 0,
+	                                 sizeof(hdr) + zl->offs))) {
+		return (err);
+	}
+	zl->head = pg;
+	if (++zl->seq - zl->tail_seq > (uint32_t) zl->pg_num) {
+		// Oldest page overwritten.
+		zl->tail_seq++;
+	}
+	memmove(zl->raw, zl->raw + zl->enc, zl->fill - zl->enc);
+	zl->fill -= zl->enc;
+	zl->enc = zl->offs = 0;
+	return (0);
+}
+
+/**
+ * rd_byte
+ */
+static int rd_byte(struct zrd *r)
+{
+	int err;
+
+	if (r->i == r->n) {
+		if (r->offs == r->end) {
+			return (-EDATA);
+		}
+		r->n = (r->end - r->offs < AT45DB_ZLOG_CHUNK) ? r->end - r->offs : AT45DB_ZLOG_CHUNK;
+		if (0 != (err = at45db_read_cont(r->fi, AT45DB_READ_CONT_HF0, r->b, r->page, r->offs,
+		                                 r->n))) {
+			return (err);
+		}
+		r->offs += r->n;
+		r->i = 0;
+	}
+	return (r->b[r->i++]);
+}
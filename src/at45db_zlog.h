@@ -0,0 +1,111 @@
+/*
+ * at45db_zlog.h
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef AT45DB_ZLOG_H
+#define AT45DB_ZLOG_H
+
+// Size of LZSS group (flag byte and 8 items).
+#define AT45DB_ZLOG_GRP_SIZE 17
+
+// Compressed log descriptor.
+typedef struct at45db_zlog_dsc *at45db_zlog;
+
+struct at45db_zlog_dsc {
+        at45db fi;          // <SetIt>
+        int bfn;            // <SetIt> Flash buffer used by log (1 or 2).
+        int start_page;     // <SetIt> First flash page of log.
+        int pg_num;         // <SetIt> Count of flash pages of log (>= 2).
+        int win;            // <SetIt> Raw data per page (64 - 4096, window size).
+        unsigned char *raw; // <SetIt> NULL
+        unsigned char *pg;  // <SetIt> NULL
+        int fill;           // <SetIt> 0
+        int enc;            // <SetIt> 0
+        int offs;           // <SetIt> 0
+        unsigned char grp[AT45DB_ZLOG_GRP_SIZE];
+        int grp_len;        // <SetIt> 0
+        int grp_cnt;        // <SetIt> 0
+        int head;           // <SetIt> 0
+        uint32_t seq;       // <SetIt> 0
+        uint32_t tail_seq;  // <SetIt> 0
+};
+
+/**
+ * at45db_zlog_mount - mount compressed log.
+ *
+ * Log is ring of pages. Each page holds LZSS compressed data of up to win
+ * raw bytes and is decodable independently of other pages. Compressor
+ * needs win bytes of RAM for raw data and RAM image of page for compressed
+ * output.
+ *
+ * @zl: Log instance.
+ *
+ * Returns: 0 - success; -EADDR - bad configuration; -EHW - hardware error.
+ */
+int at45db_zlog_mount(at45db_zlog zl);
+
+/**
+ * at45db_zlog_write - append data to log.
+ *
+ * Page is written by at45db_write_mem() when its compressed data are
+ * complete.
+ *
+ * @zl: Log instance.
+ * @data: Data.
+ * @len: Data length.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_zlog_write(at45db_zlog zl, const void *data, int len);
+
+/**
+ * at45db_zlog_sync - program pending data.
+ *
+ * Current page is closed, rest of page is unused.
+ *
+ * @zl: Log instance.
+ *
+ * Returns: 0 - success; -EHW - hardware error; -EDATA - write error.
+ */
+int at45db_zlog_sync(at45db_zlog zl);
+
+/**
+ * at45db_zlog_pages - get count of programmed log pages.
+ *
+ * @zl: Log instance.
+ *
+ * Returns: Count of pages.
+ */
+int at45db_zlog_pages(at45db_zlog zl);
+
+/**
+ * at45db_zlog_read - read and decompress log page.
+ *
+ * Compressed data are read by at45db_read_cont() in small chunks.
+ *
+ * @zl: Log instance.
+ * @idx: Page index (0 - oldest page).
+ * @buf: Buffer for raw data (win bytes).
+ * @size: Size of buffer.
+ *
+ * Returns: Raw data length (>= 0); -EADDR - bad index or small buffer;
+ *          -EHW - hardware error; -EDATA - corrupted page.
+ */
+int at45db_zlog_read(at45db_zlog zl, int idx, void *buf, int size);
+
+#endif
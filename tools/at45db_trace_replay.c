@@ -0,0 +1,414 @@
+/*
+ * at45db_trace_replay.c
+ *
+ * Copyright (c) 2024 Jan Rusnak <jan@rusnak.sk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Host replayer of AT45DB SPI transaction trace.
+ *
+ * Trace is binary dump of struct at45db_trace_rec records (little endian)
+ * obtained by at45db_trace_read(). Transactions are fed into flash model
+ * which tracks busy time of self-timed operations and content of SRAM
+ * buffers. Report shows command statistics, status polling per operation,
+ * commands issued while device busy, redundant buffer loads and stores and
+ * page reads which could be served from buffer.
+ *
+ * Build: cc -std=c99 -o at45db_trace_replay at45db_trace_replay.c
+ *
+ * Usage: at45db_trace_replay [-p page_size] [-u us_per_time_unit] [-v] trace.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define REC_SIZE 12
+
+#define TRACE_DMA (0x1 << 0)
+#define TRACE_ERR (0x1 << 1)
+
+enum kind {
+	K_OTHER,
+	K_STAT,
+	K_READ,
+	K_CONT_READ,
+	K_BUF_READ,
+	K_BUF_WRITE,
+	K_LOAD,
+	K_CMP,
+	K_STORE_ERASE,
+	K_STORE,
+	K_PROG,
+	K_PAGE_ERASE,
+	K_BLOCK_ERASE,
+	K_CHIP_ERASE,
+	K_RMW,
+	K_PWR_DOWN,
+	K_UDPD,
+	K_RESUME
+};
+
+struct op_dsc {
+	uint8_t op;
+	enum kind kind;
+	int bfn;
+	const char *name;
+};
+
+static const struct op_dsc op_tab[] = {
+	{0xD7, K_STAT, 0, "status"},
+	{0xD2, K_READ, 0, "page read"},
+	{0x0B, K_CONT_READ, 0, "cont read HF0"},
+	{0x1B, K_CONT_READ, 0, "cont read HF1"},
+	{0x03, K_CONT_READ, 0, "cont read LF"},
+	{0x01, K_CONT_READ, 0, "cont read LP"},
+	{0xE8, K_CONT_READ, 0, "cont read legacy"},
+	{0xD4, K_BUF_READ, 1, "buf1 read"},
+	{0xD6, K_BUF_READ, 2, "buf2 read"},
+	{0xD1, K_BUF_READ, 1, "buf1 read LF"},
+	{0xD3, K_BUF_READ, 2, "buf2 read LF"},
+	{0x84, K_BUF_WRITE, 1, "buf1 write"},
+	{0x87, K_BUF_WRITE, 2, "buf2 write"},
+	{0x53, K_LOAD, 1, "page to buf1"},
+	{0x55, K_LOAD, 2, "page to buf2"},
+	{0x60, K_CMP, 1, "page cmp buf1"},
+	{0x61, K_CMP, 2, "page cmp buf2"},
+	{0x83, K_STORE_ERASE, 1, "buf1 to page erase"},
+	{0x86, K_STORE_ERASE, 2, "buf2 to page erase"},
+	{0x88, K_STORE, 1, "buf1 to page"},
+	{0x89, K_STORE, 2, "buf2 to page"},
+	{0x82, K_PROG, 1, "page prog buf1"},
+	{0x85, K_PROG, 2, "page prog buf2"},
+	{0x81, K_PAGE_ERASE, 0, "page erase"},
+	{0x50, K_BLOCK_ERASE, 0, "block erase"},
+	{0xC7, K_CHIP_ERASE, 0, "chip erase"},
+	{0x58, K_RMW, 1, "rewrite buf1"},
+	{0x59, K_RMW, 2, "rewrite buf2"},
+	{0xB9, K_PWR_DOWN, 0, "deep pwr down"},
+	{0x79, K_UDPD, 0, "ultra deep pwr down"},
+	{0xAB, K_RESUME, 0, "resume"},
+	{0x9F, K_OTHER, 0, "read id"},
+	{0x3D, K_OTHER, 0, "prot cmd"},
+	{0x32, K_OTHER, 0, "read prot reg"},
+	{0x35, K_OTHER, 0, "read lock reg"},
+	{0x77, K_OTHER, 0, "read sec reg"},
+	{0x9B, K_OTHER, 0, "prog sec reg"}
+};
+
+#define OP_TAB_SIZE (int) (sizeof(op_tab) / sizeof(op_tab[0]))
+
+// Typical operation times (us).
+struct part_tm {
+	int pg_size;
+	int pg_count;
+	int store_erase;
+	int store;
+	int page_erase;
+	int block_erase;
+	int rmw;
+	int xfr;
+	int chip_erase;
+};
+
+static const struct part_tm part_tm[] = {
+	{1056, 8192, 20000, 14000, 8000, 12000, 21000, 200, 80000000},
+	{264, 32768, 8000, 2000, 6000, 25000, 9000, 200, 80000000}
+};
+
+enum buf_state {
+	BUF_UNKNOWN,
+	BUF_MATCH,
+	BUF_MODIFIED
+};
+
+struct buf_model {
+	enum buf_state state;
+	int page;
+};
+
+struct op_stat {
+	unsigned long cnt;
+	unsigned long bytes;
+	unsigned long err;
+	unsigned long dma;
+};
+
+static const struct part_tm *tm;
+static struct buf_model bm[2];
+static struct op_stat stat[OP_TAB_SIZE + 1];
+static double busy_until;
+static int busy_idx = -1;
+static unsigned long polls, early_polls, busy_ops, max_polls, op_polls;
+static unsigned long busy_cmds, redund_load, redund_store, buf_reads, reread;
+static int last_read = -1;
+
+static const struct op_dsc *find_op(uint8_t op, int *idx);
+static void replay(double t, uint8_t op, uint32_t addr, int len, uint8_t flags, int verb);
+static void page_changed(int page, int num, int keep_bfn);
+static int op_time(enum kind kind);
+static void report(void);
+
+int main(int argc, char **argv)
+{
+	unsigned char r[REC_SIZE];
+	double us = 1000;
+	int pg_size = 1056, verb = 0, i;
+	FILE *f;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-p") && i + 1 < argc - 1) {
+			pg_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-u") && i + 1 < argc - 1) {
+			us = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-v")) {
+			verb = 1;
+		} else {
+			break;
+		}
+	}
+	if (i != argc - 1) {
+		fprintf(stderr, "usage: %s [-p page_size] [-u us_per_time_unit] [-v] trace.bin\n",
+		        argv[0]);
+		return (1);
+	}
+	for (int j = 0; j < (int) (sizeof(part_tm) / sizeof(part_tm[0])); j++) {
+		if (part_tm[j].pg_size == pg_size) {
+			tm = &part_tm[j];
+		}
+	}
+	if (tm == NULL) {
+		fprintf(stderr, "unsupported page size %d (264 or 1056)\n", pg_size);
+		return (1);
+	}
+	if (NULL == (f = fopen(argv[i], "rb"))) {
+		perror(argv[i]);
+		return (1);
+	}
+	while (fread(r, 1, REC_SIZE, f) == REC_SIZE) {
+		uint32_t t = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t) r[3] << 24);
+		uint32_t addr = r[4] | (r[5] << 8) | (r[6] << 16) | ((uint32_t) r[7] << 24);
+		int len = r[8] | (r[9] << 8);
+
+		replay(t * us, r[10], addr, len, r[11], verb);
+	}
+	fclose(f);
+	report();
+	return (0);
+}
+
+/**
+ * find_op
+ */
+static const struct op_dsc *find_op(uint8_t op, int *idx)
+{
+	for (int i = 0; i < OP_TAB_SIZE; i++) {
+		if (op_tab[i].op == op) {
+			*idx = i;
+			return (&op_tab[i]);
+		}
+	}
+	*idx = OP_TAB_SIZE;
+	return (NULL);
+}
+
+/**
+ * replay
+ */
+static void replay(double t, uint8_t op, uint32_t addr, int len, uint8_t flags, int verb)
+{
+	const struct op_dsc *d;
+	int idx, page, offs, b;
+	int sh = (tm->pg_size == 1056) ? 11 : 9;
+
+	d = find_op(op, &idx);
+	page = (addr >> sh) & (tm->pg_count - 1);
+	offs = addr & ((1 << sh) - 1);
+	stat[idx].cnt++;
+	stat[idx].bytes += len;
+	if (flags & TRACE_ERR) {
+		stat[idx].err++;
+	}
+	if (flags & TRACE_DMA) {
+		stat[idx].dma++;
+	}
+	if (verb) {
+		printf("%12.0f %02X %-20s page %5d offs %4d len %5d%s%s\n", t, op,
+		       (d) ? d->name : "?", page, offs, len, (flags & TRACE_DMA) ? " dma" : "",
+		       (flags & TRACE_ERR) ? " ERR" : "");
+	}
+	if (d == NULL || (flags & TRACE_ERR)) {
+		return;
+	}
+	if (d->kind == K_STAT) {
+		polls++;
+		op_polls++;
+		if (busy_idx >= 0 && t < busy_until) {
+			early_polls++;
+		}
+		return;
+	}
+	if (busy_idx >= 0) {
+		// Previous self-timed operation finished.
+		if (op_polls > max_polls) {
+			max_polls = op_polls;
+		}
+		if (t < busy_until && d->kind != K_RESUME) {
+			busy_cmds++;
+			if (verb) {
+				printf("  command issued %.0f us before end of %s\n", busy_until - t,
+				       op_tab[busy_idx].name);
+			}
+		}
+		busy_idx = -1;
+	}
+	b = d->bfn - 1;
+	switch (d->kind) {
+	case K_READ :
+		for (int i = 0; i < 2; i++) {
+			if (bm[i].state == BUF_MATCH && bm[i].page == page) {
+				buf_reads++;
+			}
+		}
+		if (page == last_read) {
+			reread++;
+		}
+		last_read = page;
+		break;
+	case K_BUF_WRITE :
+		if (bm[b].state == BUF_MATCH) {
+			bm[b].state = BUF_MODIFIED;
+		}
+		break;
+	case K_LOAD :
+		if (bm[b].state == BUF_MATCH && bm[b].page == page) {
+			redund_load++;
+		}
+		bm[b].state = BUF_MATCH;
+		bm[b].page = page;
+		break;
+	case K_STORE_ERASE :
+		/* FALLTHRU */
+	case K_STORE :
+		if (bm[b].state == BUF_MATCH && bm[b].page == page) {
+			redund_store++;
+		}
+		/* FALLTHRU */
+	case K_PROG :
+		page_changed(page, 1, b);
+		bm[b].state = BUF_MATCH;
+		bm[b].page = page;
+		break;
+	case K_RMW :
+		bm[b].state = BUF_MATCH;
+		bm[b].page = page;
+		break;
+	case K_PAGE_ERASE :
+		page_changed(page, 1, -1);
+		break;
+	case K_BLOCK_ERASE :
+		page_changed(page & ~7, 8, -1);
+		break;
+	case K_CHIP_ERASE :
+		page_changed(0, tm->pg_count, -1);
+		break;
+	case K_UDPD :
+		bm[0].state = bm[1].state = BUF_UNKNOWN;
+		break;
+	default :
+		break;
+	}
+	if (d->kind != K_READ) {
+		last_read = -1;
+	}
+	if (op_time(d->kind)) {
+		busy_idx = idx;
+		busy_until = t + op_time(d->kind);
+		busy_ops++;
+		op_polls = 0;
+	}
+}
+
+/**
+ * page_changed
+ */
+static void page_changed(int page, int num, int keep_bfn)
+{
+	for (int i = 0; i < 2; i++) {
+		if (i != keep_bfn && bm[i].state != BUF_UNKNOWN && bm[i].page >= page &&
+		    bm[i].page < page + num) {
+			bm[i].state = BUF_UNKNOWN;
+		}
+	}
+	if (last_read >= page && last_read < page + num) {
+		last_read = -1;
+	}
+}
+
+/**
+ * op_time
+ */
+static int op_time(enum kind kind)
+{
+	switch (kind) {
+	case K_LOAD :
+		/* FALLTHRU */
+	case K_CMP :
+		return (tm->xfr);
+	case K_STORE_ERASE :
+		/* FALLTHRU */
+	case K_PROG :
+		return (tm->store_erase);
+	case K_STORE :
+		return (tm->store);
+	case K_PAGE_ERASE :
+		return (tm->page_erase);
+	case K_BLOCK_ERASE :
+		return (tm->block_erase);
+	case K_CHIP_ERASE :
+		return (tm->chip_erase);
+	case K_RMW :
+		return (tm->rmw);
+	default :
+		return (0);
+	}
+}
+
+/**
+ * report
+ */
+static void report(void)
+{
+	if (busy_idx >= 0 && op_polls > max_polls) {
+		max_polls = op_polls;
+	}
+	printf("%-22s %10s %12s %8s %8s\n", "command", "count", "bytes", "dma", "errors");
+	for (int i = 0; i <= OP_TAB_SIZE; i++) {
+		if (stat[i].cnt) {
+			printf("%-22s %10lu %12lu %8lu %8lu\n", (i < OP_TAB_SIZE) ? op_tab[i].name : "unknown",
+			       stat[i].cnt, stat[i].bytes, stat[i].dma, stat[i].err);
+		}
+	}
+	printf("\nself-timed operations     %lu\n", busy_ops);
+	printf("status polls              %lu (%.1f per operation, max %lu)\n", polls,
+	       (busy_ops) ? (double) polls / busy_ops : 0.0, max_polls);
+	printf("polls before model ready  %lu\n", early_polls);
+	printf("commands while busy       %lu\n", busy_cmds);
+	printf("redundant buffer loads    %lu\n", redund_load);
+	printf("redundant buffer stores   %lu\n", redund_store);
+	printf("page reads held in buffer %lu\n", buf_reads);
+	printf("repeated page reads       %lu\n", reread);
+}